@@ -0,0 +1,64 @@
+#pragma once
+
+/* Binary snapshot helpers shared by the modules taking part in a
+ * checkpoint. A snapshot is only taken when every device is waiting for
+ * the next time slot, so the writers below do not need any locking. */
+
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECKPOINT_MAGIC 0x4b43534fU // "OSCK"
+#define CHECKPOINT_VERSION 19
+
+static inline void ckpt_write(FILE *file, const void *data, size_t size) {
+    if (fwrite(data, 1, size, file) != size) {
+        printf("Cannot write checkpoint\n");
+        exit(1);
+    }
+}
+
+static inline void ckpt_read(FILE *file, void *data, size_t size) {
+    if (fread(data, 1, size, file) != size) {
+        printf("Checkpoint is truncated\n");
+        exit(1);
+    }
+}
+
+static inline void ckpt_write_u32(FILE *file, uint32_t value) {
+    ckpt_write(file, &value, sizeof(value));
+}
+
+static inline uint32_t ckpt_read_u32(FILE *file) {
+    uint32_t value;
+    ckpt_read(file, &value, sizeof(value));
+    return value;
+}
+
+static inline void ckpt_write_u64(FILE *file, uint64_t value) {
+    ckpt_write(file, &value, sizeof(value));
+}
+
+static inline uint64_t ckpt_read_u64(FILE *file) {
+    uint64_t value;
+    ckpt_read(file, &value, sizeof(value));
+    return value;
+}
+
+/* Physical memory: _mem_stat and every non-zero frame of _ram */
+void save_mem(FILE *file);
+void restore_mem(FILE *file);
+
+/* Segment and page tables of a process */
+void save_seg_table(FILE *file, const struct seg_table_t *seg_table);
+struct seg_table_t *restore_seg_table(FILE *file);
+
+/* A whole PCB including its code and memory mappings, and the PID counter */
+void save_proc(FILE *file, const struct pcb_t *proc);
+struct pcb_t *restore_proc(FILE *file);
+void save_loader(FILE *file);
+void restore_loader(FILE *file);
+
+/* Ready and run queues together with the processes in them */
+void save_scheduler(FILE *file);
+void restore_scheduler(FILE *file);
@@ -20,6 +20,10 @@
 #define PAGE_SIZE (1 << OFFSET_LEN) // 1kb page size
 #define MAX_SEGMENT_COUNT (1 << SEGMENT_LEN)
 #define MAX_PAGE_PER_SEGMENT (1 << PAGE_LEN)
+#define PTE_ACCESSED 1 // The page has been read or written since the last sample
+#define PTE_DIRTY 2    // The page has been written since the last sample
+#define MAX_LOOP_DEPTH 8 // Nesting limit of REPEAT blocks
+#define NUM_REGS 10      // Registers of a process
 
 typedef char BYTE;
 typedef uint32_t addr_t;
@@ -29,7 +33,19 @@ enum ins_opcode_t {
     ALLOC, // Allocate memory
     FREE,  // Deallocated a memory block
     READ,  // Write data to a byte on memory
-    WRITE  // Read data from a byte on memory
+    WRITE, // Read data from a byte on memory
+    FORK,       // Clone the process, its memory is shared copy-on-write
+    SHM_CREATE, // Create a named shared memory segment and map it
+    SHM_ATTACH, // Map an existing shared memory segment
+    SHM_DETACH, // Unmap a shared memory segment
+    SET,        // Load a constant into a register
+    IO,         // Block on I/O for [arg_0] slots, leaving the CPU to others
+    /* Control flow, executed without taking a time slot */
+    REPEAT, // Run the block up to the matching END [arg_0] times
+    END,    // End of a REPEAT block
+    LOOP,   // Decrement a register and jump if it is not zero
+    JNZ,    // Jump if a register is not zero
+    JZ      // Jump if a register is zero
 };
 
 /* instructions executed by the CPU */
@@ -50,6 +66,7 @@ struct page_table_t {
     struct {
         addr_t v_index; // The index of virtual address
         addr_t p_index; // The index of physical address
+        uint32_t flags; // PTE_ACCESSED and PTE_DIRTY
     } pages[1 << PAGE_LEN];
     uint32_t page_count;
 };
@@ -59,7 +76,9 @@ struct seg_table_t {
     /* Translation table for the first layer */
     struct {
         addr_t v_index; // Virtual index
-        struct page_table_t *pages_table;
+        struct page_table_t *pages_table; // NULL for a huge segment
+        addr_t huge_base; // First of the contiguous frames of a huge segment
+        uint32_t flags;   // PTE_* bits of a huge segment
     } segments[1 << SEGMENT_LEN];
     uint32_t segment_count; // Number of row in the first layer
 };
@@ -69,10 +88,23 @@ struct pcb_t {
     uint32_t pid; // PID
     uint32_t priority;
     struct code_seg_t *code;       // Code segment
-    addr_t regs[10];               // Registers, store address of allocated regions
+    addr_t regs[NUM_REGS];         // Registers, store address of allocated regions
     uint32_t pc;                   // Program pointer, point to the next instruction
     struct seg_table_t *seg_table; // Page table
-    uint32_t bp;                   // Break pointer
+    uint32_t bp;                   // Highest virtual address ever allocated
+    struct vspace_t *vspace;       // Free ranges of the virtual address space
+    int last_cpu;                  // CPU which ran the process last, -1 if none
+    uint32_t migrations;           // Number of dispatches on a different CPU
+    uint32_t cold_slots;           // Slots lost refilling a cold cache
+    uint32_t stall;                // Slots left before it can run on last_cpu
+    uint64_t deadline;             // Absolute deadline slot, 0 if not real-time
+    uint32_t rel_deadline;         // Deadline relative to the arrival
+    struct {
+        uint32_t start; // First instruction of the block
+        uint32_t left;  // Iterations left, including the current one
+    } loops[MAX_LOOP_DEPTH];       // Active REPEAT blocks
+    uint32_t loop_depth;
+    uint32_t io_ticks;             // I/O requested by the last instruction
 };
 
 // each program have 32 segment
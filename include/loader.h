@@ -1,4 +1,7 @@
 #pragma once
 #include "common.h"
 
-struct pcb_t* load(const char* path);
\ No newline at end of file
+struct pcb_t* load(const char* path);
+
+/* Create a copy of [proc] with a new PID, sharing its code and memory */
+struct pcb_t* clone_proc(struct pcb_t* proc);
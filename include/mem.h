@@ -1,5 +1,6 @@
 #pragma once
 #include "common.h"
+#include <stdio.h>
 
 #define RAM_SIZE (1 << ADDRESS_SIZE)
 
@@ -23,4 +24,55 @@ int read_mem(addr_t address, struct pcb_t* proc, BYTE* data);
  * [proc]. If given [address] is valid, return 0. Otherwise, return 1 */
 int write_mem(addr_t address, struct pcb_t* proc, BYTE data);
 
-void dump(void);
\ No newline at end of file
+/* Give [child] the same mappings as [parent]. Frames are shared and only
+ * copied when one of the processes writes to them */
+void fork_mem(struct pcb_t* parent, struct pcb_t* child);
+
+/* Create the shared memory segment [key] of [size] bytes and map it into
+ * [proc]. Return its virtual address, or 0 if [key] is already in use or
+ * there is not enough memory */
+addr_t shm_create(uint32_t key, uint32_t size, struct pcb_t* proc);
+
+/* Map the existing shared memory segment [key] into [proc] and return its
+ * virtual address, or 0 if there is no such segment. Segments are
+ * detached with free_mem and destroyed with their last mapping */
+addr_t shm_attach(uint32_t key, struct pcb_t* proc);
+
+/* Count the pages of [proc] accessed and written since the previous call,
+ * credit their frames in the heat map and clear the bits. Must be called
+ * at a slot boundary */
+void harvest_pages(struct pcb_t* proc, uint32_t* accessed, uint32_t* dirty);
+
+/* Write the heat map as CSV: every frame accessed in at least one sample
+ * with its current owner and the number of samples it was accessed and
+ * written in */
+void dump_heat(FILE* file);
+
+/* Number of pages mapped by [proc] */
+uint32_t mem_pages(struct pcb_t* proc);
+
+/* Print how many segments have been mapped huge and how many pages
+ * through page tables, if any huge segment has been used */
+void report_pages(void);
+
+/* Move up to [budget] frames in use to the lowest free frames, updating
+ * the page tables of [procs], which must hold every live process. Frames
+ * of huge segments stay in place. Once a pass is complete, print the
+ * largest run of free frames before and after the slot which ended it.
+ * Must be called at a slot boundary */
+void compact_mem(uint32_t budget, struct pcb_t** procs, int count);
+
+#define DUMP_IMAGE_MAGIC 0x49534f4dU // "MOSI"
+
+/* Print every frame in use with its non-zero bytes to stdout */
+void dump(void);
+
+/* Like dump, but only the frames written since the previous dump */
+void dump_dirty(void);
+
+/* Write the frames in use to [file] as a binary sparse image: the magic,
+ * NUM_PAGES and PAGE_SIZE as 32-bit words, then for every frame its index,
+ * PID, index and next as 32-bit words followed by (offset, length) 16-bit
+ * pairs and the bytes of each run, closed by (PAGE_SIZE, 0). A frame
+ * index of -1 ends the image */
+void dump_image(FILE* file);
@@ -1,15 +1,24 @@
 #pragma once
 #include "common.h"
 
-#define MAX_QUEUE_SIZE 10
-
 struct queue_t {
-    struct pcb_t *proc[MAX_QUEUE_SIZE];
+    struct pcb_t **proc; // Grows on demand, processes may fork at any time
     int size;
+    int capacity;
 };
 
 void enqueue(struct queue_t *q, struct pcb_t *proc);
 
 struct pcb_t *dequeue(struct queue_t *q);
 
+/* Like dequeue, but return the best process which ran on [cpu] last if its
+ * priority is within [window] of the highest one */
+struct pcb_t *dequeue_affine(struct queue_t *q, int cpu, uint32_t window);
+
+/* Earliest deadline among the real-time processes in [q], 0 if none */
+uint64_t earliest_deadline(struct queue_t *q);
+
+/* Remove and return the real-time process with the earliest deadline */
+struct pcb_t *dequeue_earliest(struct queue_t *q);
+
 int empty(struct queue_t *q);
\ No newline at end of file
@@ -6,11 +6,53 @@ int queue_empty(void);
 void init_scheduler(void);
 void finish_scheduler(void);
 
-/* Get the next process from ready queue */
-struct pcb_t* get_proc(void);
+/* Get the next process from ready queue for CPU [cpu] */
+struct pcb_t* get_proc(int cpu);
 
 /* Put a process back to run queue */
 void put_proc(struct pcb_t* proc);
 
 /* Add a new process to ready queue */
-void add_proc(struct pcb_t* proc);
\ No newline at end of file
+void add_proc(struct pcb_t* proc);
+
+/* Prefer processes which ran on the requesting CPU last, as long as their
+ * priority is at most [window] below the best one. This is a priority
+ * window, not a bound on queue lengths. A negative [window] disables
+ * affinity */
+void set_affinity_window(int window);
+
+/* Real-time processes are scheduled earliest deadline first, ahead of the
+ * priority class. [capacity] is the total utilization admitted at once,
+ * usually the number of CPUs */
+void set_rt_capacity(uint32_t capacity);
+
+/* Admission control: make [proc] a real-time process with a deadline
+ * [relative] slots after [now] if the utilization allows it, both in total
+ * and for this process alone on a single CPU. Return 1 if it has been
+ * admitted, 0 if it stays in the priority class */
+int admit_proc(struct pcb_t* proc, uint32_t relative, uint64_t now);
+
+/* Release the utilization of a real-time process finishing at [now].
+ * Return 1 if it has missed its deadline */
+int finish_proc(struct pcb_t* proc, uint64_t now);
+
+/* Print the deadline accounting, if any real-time process was seen */
+void report_rt(void);
+
+/* Block [proc] on I/O until slot [wake] */
+void wait_proc(struct pcb_t* proc, uint64_t wake);
+
+/* Move the processes whose I/O is over at slot [now] to the ready queue.
+ * Return how many there were */
+int wake_procs(uint64_t now);
+
+/* Number of processes blocked on I/O */
+int waiting_procs(void);
+
+/* Call [fn] on every process in the ready, run and wait queues. Processes
+ * held by the CPUs are not included */
+void for_each_proc(void (*fn)(struct pcb_t* proc, void* arg), void* arg);
+
+/* Call [handler] every time a process is added or put back to a queue,
+ * used to wake up idle CPUs */
+void set_wake_handler(void (*handler)(void));
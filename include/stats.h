@@ -0,0 +1,55 @@
+#pragma once
+
+/* Low-overhead runtime instrumentation. Counters are always compiled in,
+ * stored per thread and only touched while collection is enabled. */
+
+#include <pthread.h>
+#include <stdint.h>
+
+enum stat_lock_t {
+    STAT_LOCK_MEM,   // mem_lock in mem.c
+    STAT_LOCK_QUEUE, // queue_lock in sched.c
+    STAT_LOCK_EVENT, // event_lock of timer devices
+    STAT_LOCK_TIMER, // timer_lock of timer devices
+    STAT_LOCK_COUNT
+};
+
+enum stat_func_t {
+    STAT_FN_TRANSLATE,
+    STAT_FN_ALLOC,
+    STAT_FN_FREE,
+    STAT_FN_COUNT
+};
+
+enum stat_format_t {
+    STAT_FORMAT_TABLE,
+    STAT_FORMAT_JSON
+};
+
+extern volatile int stats_on;
+
+/* Read the OS_STATS environment variable ("table" or "json") and install
+ * the signal handlers: SIGUSR1 requests a dump, SIGUSR2 toggles collection.
+ * [num_cpus] is the number of simulated CPUs whose slots are accounted */
+void init_stats(int num_cpus);
+
+/* Current monotonic time in nanoseconds, or 0 if collection is disabled */
+uint64_t stats_begin(void);
+
+/* Account the time elapsed since [start] (returned by stats_begin) to [fn] */
+void stats_end(enum stat_func_t fn, uint64_t start);
+
+/* Drop-in replacements for pthread_mutex_lock/unlock/pthread_cond_wait
+ * recording wait and hold time of lock class [id] */
+void stats_lock(pthread_mutex_t *lock, enum stat_lock_t id);
+void stats_unlock(pthread_mutex_t *lock, enum stat_lock_t id);
+void stats_cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock, enum stat_lock_t id);
+
+/* Account [slots] time slots of CPU [cpu] as running ([busy] != 0) or idle */
+void stats_cpu_slots(int cpu, int busy, uint64_t slots);
+
+/* Dump the collected data if SIGUSR1 was received since the last call */
+void stats_poll(void);
+
+/* Write every counter to stderr */
+void stats_dump(void);
@@ -5,6 +5,8 @@
 struct timer_id_t {
     int             done;
     int             fsh;
+    int             parked; // Skipped by the timer until woken up
+    int             wake;   // Resume a parked device at the next slot
     pthread_cond_t  event_cond;
     pthread_mutex_t event_lock;
     pthread_cond_t  timer_cond;
@@ -21,4 +23,22 @@ void detach_event(struct timer_id_t* event);
 
 void next_slot(struct timer_id_t* timer_id);
 
-uint64_t current_time();
\ No newline at end of file
+/* Like next_slot, but the device stays asleep and the timer stops waiting
+ * for it until unpark_event is called. It then resumes at the following
+ * slot boundary */
+void park_slot(struct timer_id_t* timer_id);
+
+void unpark_event(struct timer_id_t* timer_id);
+
+uint64_t current_time();
+
+/* Move the clock to the next slot. Only called by the timer thread, or
+ * directly when the devices are simulated without it */
+void advance_time(void);
+
+/* Restart the clock from [time], must be called before start_timer */
+void set_time(uint64_t time);
+
+/* Call [hook] whenever the clock reaches a new slot while every device
+ * is still waiting for it. Passing NULL removes the hook */
+void set_tick_hook(void (*hook)(uint64_t time));
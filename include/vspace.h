@@ -0,0 +1,52 @@
+#pragma once
+
+/* Per-process allocator of virtual pages. Free ranges are kept as extents
+ * in size-segregated lists and coalesced with their neighbours when pages
+ * are given back, so holes left by free_mem are reused */
+
+#include "common.h"
+#include <stdio.h>
+
+#define VSPACE_BUCKETS (PAGE_LEN + SEGMENT_LEN + 1) // one per power of two
+
+struct vm_extent_t {
+    uint32_t start; // First free page
+    uint32_t count; // Number of free pages
+    struct vm_extent_t *prev;
+    struct vm_extent_t *next;
+};
+
+struct vspace_t {
+    /* Bucket i holds the extents of 2^i to 2^(i+1) - 1 pages */
+    struct vm_extent_t *buckets[VSPACE_BUCKETS];
+    struct vm_extent_t *head[NUM_PAGES]; // Extent starting at a page
+    struct vm_extent_t *tail[NUM_PAGES]; // Extent ending at a page
+    uint32_t free_pages;
+    uint32_t extents;
+};
+
+/* Create an address space where every page but the first one is free */
+struct vspace_t *vspace_create(void);
+
+struct vspace_t *vspace_clone(const struct vspace_t *vspace);
+
+void vspace_destroy(struct vspace_t *vspace);
+
+/* Reserve [count] contiguous pages and return the first one, or 0 if no
+ * free extent is large enough */
+uint32_t vspace_alloc(struct vspace_t *vspace, uint32_t count);
+
+/* Like vspace_alloc, but the first page is a multiple of [align] */
+uint32_t vspace_alloc_aligned(struct vspace_t *vspace, uint32_t count, uint32_t align);
+
+/* Give back [count] pages starting at page [start] */
+void vspace_free(struct vspace_t *vspace, uint32_t start, uint32_t count);
+
+/* Size in pages of the largest free extent */
+uint32_t vspace_largest(const struct vspace_t *vspace);
+
+/* Percentage of free pages outside of the largest free extent */
+uint32_t vspace_fragmentation(const struct vspace_t *vspace);
+
+void save_vspace(FILE *file, const struct vspace_t *vspace);
+struct vspace_t *restore_vspace(FILE *file);
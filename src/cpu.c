@@ -1,6 +1,8 @@
 
 #include "cpu.h"
+#include "loader.h"
 #include "mem.h"
+#include "sched.h"
 
 static int calc(struct pcb_t * proc) {
 	return ((unsigned long)proc & 0UL);
@@ -20,6 +22,25 @@ static int free_data(struct pcb_t * proc, uint32_t reg_index) {
 	return free_mem(proc->regs[reg_index], proc);
 }
 
+static int shm_new(struct pcb_t * proc, uint32_t key, uint32_t size,
+		uint32_t reg_index) {
+	addr_t addr = shm_create(key, size, proc);
+	if (addr == 0) {
+		return 1;
+	}
+	proc->regs[reg_index] = addr;
+	return 0;
+}
+
+static int shm_map(struct pcb_t * proc, uint32_t key, uint32_t reg_index) {
+	addr_t addr = shm_attach(key, proc);
+	if (addr == 0) {
+		return 1;
+	}
+	proc->regs[reg_index] = addr;
+	return 0;
+}
+
 static int read(
 		struct pcb_t * proc, // Process executing the instruction
 		uint32_t source, // Index of source register
@@ -44,9 +65,84 @@ static int write(
 	return write_mem(proc->regs[destination] + offset, proc, data);
 } 
 
+static int fork_proc(struct pcb_t * proc, uint32_t reg_index) {
+	struct pcb_t * child = clone_proc(proc);
+	/* The parent gets the PID of its child, the child gets 0 */
+	proc->regs[reg_index] = child->pid;
+	child->regs[reg_index] = 0;
+	add_proc(child);
+	return 0;
+}
+
+static int is_control(enum ins_opcode_t opcode) {
+	return opcode == REPEAT || opcode == END || opcode == LOOP
+		|| opcode == JNZ || opcode == JZ;
+}
+
+/* Execute the control flow instruction [ins] of [proc] */
+static void control(struct pcb_t * proc, struct inst_t ins) {
+	switch (ins.opcode) {
+	case REPEAT:
+		if (ins.arg_0 == 0) {
+			proc->pc = ins.arg_1 + 1; // skip the whole block
+		} else if (proc->loop_depth == MAX_LOOP_DEPTH) {
+			proc->pc = proc->code->size; // stack overflow, stop the process
+		} else {
+			proc->loops[proc->loop_depth].start = proc->pc;
+			proc->loops[proc->loop_depth].left = ins.arg_0;
+			proc->loop_depth++;
+		}
+		break;
+	case END:
+		if (proc->loop_depth == 0) {
+			break; // no block to close
+		}
+		if (--proc->loops[proc->loop_depth - 1].left > 0) {
+			proc->pc = proc->loops[proc->loop_depth - 1].start;
+		} else {
+			proc->loop_depth--;
+		}
+		break;
+	case LOOP:
+		if (--proc->regs[ins.arg_0] != 0) {
+			proc->pc = ins.arg_1;
+		}
+		break;
+	case JNZ:
+		if (proc->regs[ins.arg_0] != 0) {
+			proc->pc = ins.arg_1;
+		}
+		break;
+	case JZ:
+		if (proc->regs[ins.arg_0] == 0) {
+			proc->pc = ins.arg_1;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/* Follow control flow instructions from the program counter until it
+ * points to an instruction doing actual work. [budget] bounds the number
+ * of jumps so that a loop without any work cannot stall the CPU */
+static void skip_control(struct pcb_t * proc, uint32_t * budget) {
+	while (proc->pc < proc->code->size && *budget > 0
+		&& is_control(proc->code->text[proc->pc].opcode)) {
+		struct inst_t ins = proc->code->text[proc->pc];
+		proc->pc++;
+		control(proc, ins);
+		(*budget)--;
+	}
+}
+
 int run(struct pcb_t * proc) {
+	uint32_t budget = proc->code->size;
+	skip_control(proc, &budget);
+
 	/* Check if Program Counter point to the proper instruction */
-	if (proc->pc >= proc->code->size) {
+	if (proc->pc >= proc->code->size
+		|| is_control(proc->code->text[proc->pc].opcode)) {
 		return 1;
 	}
 	
@@ -54,6 +150,10 @@ int run(struct pcb_t * proc) {
 	proc->pc++;
 	int stat = 1;
 	switch (ins.opcode) {
+	case SET:
+		proc->regs[ins.arg_0] = ins.arg_1;
+		stat = 0;
+		break;
 	case CALC:
 		stat = calc(proc);
 		break;
@@ -69,9 +169,29 @@ int run(struct pcb_t * proc) {
 	case WRITE:
 		stat = write(proc, ins.arg_0, ins.arg_1, ins.arg_2);
 		break;
+	case FORK:
+		stat = fork_proc(proc, ins.arg_0);
+		break;
+	case SHM_CREATE:
+		stat = shm_new(proc, ins.arg_0, ins.arg_1, ins.arg_2);
+		break;
+	case SHM_ATTACH:
+		stat = shm_map(proc, ins.arg_0, ins.arg_1);
+		break;
+	case SHM_DETACH:
+		stat = free_data(proc, ins.arg_0);
+		break;
+	case IO:
+		/* The CPU moves the process to the wait queue */
+		proc->io_ticks = ins.arg_0;
+		stat = 0;
+		break;
 	default:
 		stat = 1;
 	}
+	/* Settle the jumps following this instruction as well, so that the
+	 * end of the program is noticed as soon as its last work is done */
+	skip_control(proc, &budget);
 	return stat;
 
 }
@@ -1,5 +1,8 @@
 
 #include "loader.h"
+#include "checkpoint.h"
+#include "mem.h"
+#include "vspace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,6 +14,17 @@ static uint32_t avail_pid = 1;
 #define OPT_FREE	"free"
 #define OPT_READ	"read"
 #define OPT_WRITE	"write"
+#define OPT_FORK	"fork"
+#define OPT_SHM_CREATE	"shm_create"
+#define OPT_SHM_ATTACH	"shm_attach"
+#define OPT_SHM_DETACH	"shm_detach"
+#define OPT_SET		"set"
+#define OPT_REPEAT	"repeat"
+#define OPT_END		"end"
+#define OPT_LOOP	"loop"
+#define OPT_JNZ		"jnz"
+#define OPT_JZ		"jz"
+#define OPT_IO		"io"
 
 static enum ins_opcode_t get_opcode(char * opt) {
 	if (!strcmp(opt, OPT_CALC)) {
@@ -23,21 +37,108 @@ static enum ins_opcode_t get_opcode(char * opt) {
 		return READ;
 	}else if (!strcmp(opt, OPT_WRITE)) {
 		return WRITE;
+	}else if (!strcmp(opt, OPT_FORK)) {
+		return FORK;
+	}else if (!strcmp(opt, OPT_SHM_CREATE)) {
+		return SHM_CREATE;
+	}else if (!strcmp(opt, OPT_SHM_ATTACH)) {
+		return SHM_ATTACH;
+	}else if (!strcmp(opt, OPT_SHM_DETACH)) {
+		return SHM_DETACH;
+	}else if (!strcmp(opt, OPT_SET)) {
+		return SET;
+	}else if (!strcmp(opt, OPT_REPEAT)) {
+		return REPEAT;
+	}else if (!strcmp(opt, OPT_END)) {
+		return END;
+	}else if (!strcmp(opt, OPT_LOOP)) {
+		return LOOP;
+	}else if (!strcmp(opt, OPT_JNZ)) {
+		return JNZ;
+	}else if (!strcmp(opt, OPT_JZ)) {
+		return JZ;
+	}else if (!strcmp(opt, OPT_IO)) {
+		return IO;
 	}else{
 		printf("Opcode: %s\n", opt);
 		exit(1);
 	}
 }
 
+static void check_reg(uint32_t reg, const char * path) {
+	if (reg >= NUM_REGS) {
+		printf("Invalid register %u in '%s'\n", reg, path);
+		exit(1);
+	}
+}
+
+/* Reject register indexes out of range and jumps which leave the code or
+ * cross the boundary of a REPEAT block, as the block stack of the PCB
+ * would no longer match the code being run. [block] holds the index + 1
+ * of the innermost REPEAT around each instruction, 0 outside of any */
+static void check_code(const struct code_seg_t * code,
+		const uint32_t * block, const char * path) {
+	for (uint32_t i = 0; i < code->size; i++) {
+		struct inst_t ins = code->text[i];
+		switch (ins.opcode) {
+		case ALLOC:
+		case SHM_ATTACH:
+			check_reg(ins.arg_1, path);
+			break;
+		case FREE:
+		case FORK:
+		case SHM_DETACH:
+		case SET:
+			check_reg(ins.arg_0, path);
+			break;
+		case READ:
+			check_reg(ins.arg_0, path);
+			check_reg(ins.arg_2, path);
+			break;
+		case WRITE:
+			check_reg(ins.arg_1, path);
+			break;
+		case SHM_CREATE:
+			check_reg(ins.arg_2, path);
+			break;
+		case LOOP:
+		case JNZ:
+		case JZ:
+			check_reg(ins.arg_0, path);
+			if (ins.arg_1 >= code->size) {
+				printf("Jump target %u out of range in '%s'\n",
+					ins.arg_1, path);
+				exit(1);
+			}
+			if (block[ins.arg_1] != block[i]) {
+				printf("Jump from %u to %u crosses a block in '%s'\n",
+					i, ins.arg_1, path);
+				exit(1);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+}
+
 struct pcb_t * load(const char * path) {
 	/* Create new PCB for the new process */
 	struct pcb_t * proc = (struct pcb_t * )malloc(sizeof(struct pcb_t));
-	proc->pid = avail_pid;
-	avail_pid++;
+	proc->pid = __atomic_fetch_add(&avail_pid, 1, __ATOMIC_RELAXED);
 	proc->seg_table =
-		(struct seg_table_t*)malloc(sizeof(struct seg_table_t));
+		(struct seg_table_t*)calloc(1, sizeof(struct seg_table_t));
 	proc->bp = PAGE_SIZE;
+	proc->vspace = vspace_create();
 	proc->pc = 0;
+	proc->last_cpu = -1;
+	proc->migrations = 0;
+	proc->cold_slots = 0;
+	proc->stall = 0;
+	proc->deadline = 0;
+	proc->rel_deadline = 0;
+	proc->loop_depth = 0;
+	proc->io_ticks = 0;
 
 	/* Read process code from file */
 	FILE * file;
@@ -45,20 +146,50 @@ struct pcb_t * load(const char * path) {
 		printf("Cannot find process description at '%s'\n", path);
 		exit(1);		
 	}
-	char opcode[10];
+	char opcode[16];
 	proc->code = (struct code_seg_t*)malloc(sizeof(struct code_seg_t));
 	fscanf(file, "%u %u", &proc->priority, &proc->code->size);
 	proc->code->text = (struct inst_t*)malloc(
 		sizeof(struct inst_t) * proc->code->size
 	);
+	uint32_t blocks[MAX_LOOP_DEPTH]; // Indexes of the open REPEAT blocks
+	uint32_t depth = 0;
+	uint32_t * block = (uint32_t*)malloc(
+		sizeof(uint32_t) * proc->code->size
+	);
 	uint32_t i = 0;
 	for (i = 0; i < proc->code->size; i++) {
-		fscanf(file, "%s", opcode);
+		fscanf(file, "%15s", opcode);
 		proc->code->text[i].opcode = get_opcode(opcode);
+		/* An END belongs to the block it closes */
+		block[i] = depth ? blocks[depth - 1] + 1 : 0;
 		switch(proc->code->text[i].opcode) {
 		case CALC:
 			break;
+		case REPEAT:
+			fscanf(file, "%u\n", &proc->code->text[i].arg_0);
+			if (depth == MAX_LOOP_DEPTH) {
+				printf("Too many nested blocks in '%s'\n", path);
+				exit(1);
+			}
+			blocks[depth++] = i;
+			break;
+		case END:
+			/* Link the block with its REPEAT in both directions */
+			if (depth == 0) {
+				printf("Unmatched end in '%s'\n", path);
+				exit(1);
+			}
+			depth--;
+			proc->code->text[i].arg_0 = blocks[depth];
+			proc->code->text[blocks[depth]].arg_1 = i;
+			break;
 		case ALLOC:
+		case SHM_ATTACH:
+		case SET:
+		case LOOP:
+		case JNZ:
+		case JZ:
 			fscanf(
 				file,
 				"%u %u\n",
@@ -67,10 +198,14 @@ struct pcb_t * load(const char * path) {
 			);
 			break;
 		case FREE:
+		case FORK:
+		case SHM_DETACH:
+		case IO:
 			fscanf(file, "%u\n", &proc->code->text[i].arg_0);
 			break;
 		case READ:
 		case WRITE:
+		case SHM_CREATE:
 			fscanf(
 				file,
 				"%u %u %u\n",
@@ -84,8 +219,92 @@ struct pcb_t * load(const char * path) {
 			exit(1);
 		}
 	}
+	if (depth != 0) {
+		printf("Unmatched repeat in '%s'\n", path);
+		exit(1);
+	}
+	check_code(proc->code, block, path);
+	free(block);
+	fclose(file);
 	return proc;
 }
 
+struct pcb_t * clone_proc(struct pcb_t * proc) {
+	struct pcb_t * child = (struct pcb_t * )malloc(sizeof(struct pcb_t));
+	memcpy(child, proc, sizeof(struct pcb_t));
+	child->pid = __atomic_fetch_add(&avail_pid, 1, __ATOMIC_RELAXED);
+	child->last_cpu = -1;
+	child->migrations = 0;
+	child->cold_slots = 0;
+	child->stall = 0;
+	child->deadline = 0; /* Children are not admitted as real-time */
+	child->rel_deadline = 0;
+	child->seg_table =
+		(struct seg_table_t*)malloc(sizeof(struct seg_table_t));
+	fork_mem(proc, child);
+	return child;
+}
 
+void save_proc(FILE * file, const struct pcb_t * proc) {
+	ckpt_write_u32(file, proc->pid);
+	ckpt_write_u32(file, proc->priority);
+	ckpt_write_u32(file, proc->code->size);
+	ckpt_write(file, proc->code->text,
+		sizeof(struct inst_t) * proc->code->size);
+	ckpt_write(file, proc->regs, sizeof(proc->regs));
+	ckpt_write_u32(file, proc->pc);
+	ckpt_write_u32(file, proc->bp);
+	ckpt_write_u32(file, proc->last_cpu);
+	ckpt_write_u32(file, proc->migrations);
+	ckpt_write_u32(file, proc->cold_slots);
+	ckpt_write_u32(file, proc->stall);
+	ckpt_write_u64(file, proc->deadline);
+	ckpt_write_u32(file, proc->rel_deadline);
+	ckpt_write_u32(file, proc->loop_depth);
+	ckpt_write_u32(file, proc->io_ticks);
+	ckpt_write(file, proc->loops,
+		sizeof(proc->loops[0]) * proc->loop_depth);
+	save_seg_table(file, proc->seg_table);
+	save_vspace(file, proc->vspace);
+}
 
+struct pcb_t * restore_proc(FILE * file) {
+	struct pcb_t * proc = (struct pcb_t * )malloc(sizeof(struct pcb_t));
+	proc->pid = ckpt_read_u32(file);
+	proc->priority = ckpt_read_u32(file);
+	proc->code = (struct code_seg_t*)malloc(sizeof(struct code_seg_t));
+	proc->code->size = ckpt_read_u32(file);
+	proc->code->text = (struct inst_t*)malloc(
+		sizeof(struct inst_t) * proc->code->size
+	);
+	ckpt_read(file, proc->code->text,
+		sizeof(struct inst_t) * proc->code->size);
+	ckpt_read(file, proc->regs, sizeof(proc->regs));
+	proc->pc = ckpt_read_u32(file);
+	proc->bp = ckpt_read_u32(file);
+	proc->last_cpu = (int)ckpt_read_u32(file);
+	proc->migrations = ckpt_read_u32(file);
+	proc->cold_slots = ckpt_read_u32(file);
+	proc->stall = ckpt_read_u32(file);
+	proc->deadline = ckpt_read_u64(file);
+	proc->rel_deadline = ckpt_read_u32(file);
+	proc->loop_depth = ckpt_read_u32(file);
+	proc->io_ticks = ckpt_read_u32(file);
+	if (proc->loop_depth > MAX_LOOP_DEPTH) {
+		printf("Checkpoint is corrupted\n");
+		exit(1);
+	}
+	ckpt_read(file, proc->loops,
+		sizeof(proc->loops[0]) * proc->loop_depth);
+	proc->seg_table = restore_seg_table(file);
+	proc->vspace = restore_vspace(file);
+	return proc;
+}
+
+void save_loader(FILE * file) {
+	ckpt_write_u32(file, avail_pid);
+}
+
+void restore_loader(FILE * file) {
+	avail_pid = ckpt_read_u32(file);
+}
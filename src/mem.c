@@ -1,6 +1,9 @@
 
 #include "mem.h"
+#include "checkpoint.h"
 #include "common.h"
+#include "stats.h"
+#include "vspace.h"
 #include "stdlib.h"
 #include "string.h"
 #include <pthread.h>
@@ -9,7 +12,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-static BYTE _ram[RAM_SIZE];
+static BYTE _ram[RAM_SIZE] __attribute__((aligned(64)));
+
+/* Frames written since the last dump, see dump_dirty */
+static uint8_t _dirty[NUM_PAGES];
+
+/* Number of samples in which a frame has been accessed or written */
+static struct {
+    uint32_t accessed;
+    uint32_t dirty;
+} _heat[NUM_PAGES];
 
 static struct {
     uint32_t proc; // ID of process currently uses this page
@@ -17,8 +29,39 @@ static struct {
                    // to the process.
     int next;      // The next page in the list. -1 if it is the last
                    // page.
+    uint32_t ref;  // Number of page table entries mapping this frame.
+                   // Frames shared after a fork are copied on write.
+    uint32_t shared; // Frame of a shared memory segment, never copied
+    uint32_t huge;   // Huge entries mapping this frame, which compaction
+                     // cannot move while there is any
 } _mem_stat[NUM_PAGES];
 
+/* Processes mapping a frame referenced by more than one page table entry,
+ * one entry per reference. Empty while only the owner in _mem_stat maps
+ * it, so that the owner can be handed over exactly when it lets go */
+static struct {
+    uint32_t *pids;
+    uint32_t count;
+    uint32_t capacity;
+} _mappers[NUM_PAGES];
+
+#define MAX_SHM_SEGMENTS 32
+
+/* Named shared memory segments. The frames of a segment are chained
+ * through _mem_stat starting at [first_frame] */
+static struct {
+    uint32_t key; // 0 if the slot is unused
+    uint32_t first_frame;
+    uint32_t page_count;
+} _shm_table[MAX_SHM_SEGMENTS];
+
+/* Page mapping counters */
+static struct {
+    uint64_t huge;  // Segments mapped by a single huge entry
+    uint64_t base;  // Pages mapped through a page table
+    uint64_t split; // Huge segments split into pages on copy-on-write
+} _page_stat;
+
 static pthread_mutex_t mem_lock;
 
 void init_mem(void) {
@@ -43,27 +86,44 @@ static addr_t get_second_lv(addr_t addr) {
     return (addr >> OFFSET_LEN) - (get_first_lv(addr) << PAGE_LEN);
 }
 
-/* Search for page table table from the a segment table */
+/* Search for the row of segment [index] in a segment table. Return -1 if
+ * the segment is not mapped */
+static int find_segment(addr_t index, struct seg_table_t *seg_table) {
+    for (uint32_t i = 0; i < seg_table->segment_count; i++) {
+        if (seg_table->segments[i].v_index == index) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Search for page table table from the a segment table. Huge segments
+ * have none */
 static struct page_table_t *get_page_table(
     addr_t index,                    // Segment level index
     struct seg_table_t *seg_table) { // first level table
 
-    for (uint32_t i = 0; i < seg_table->segment_count; i++) {
+    int segment = find_segment(index, seg_table);
+    return segment < 0 ? NULL : seg_table->segments[segment].pages_table;
+}
 
-        if (seg_table->segments[i].v_index == index) {
-            return seg_table->segments[i].pages_table;
-        }
+/* Set the [access] bits in [flags]. Once set, bits only go away when
+ * sampling clears them, so skip the write, and the cache line it would
+ * dirty, when none is missing */
+static void mark_access(uint32_t *flags, uint32_t access) {
+    if ((__atomic_load_n(flags, __ATOMIC_RELAXED) & access) != access) {
+        __atomic_fetch_or(flags, access, __ATOMIC_RELAXED);
     }
-    return NULL;
 }
 
 /* Translate virtual address to physical address. If [virtual_addr] is valid,
  * return 1 and write its physical counterpart to [physical_addr].
  * Otherwise, return 0 */
-static int translate(
+static int do_translate(
     addr_t virtual_addr,   // Given virtual address
     addr_t *physical_addr, // Physical address to be returned
-    struct pcb_t *proc) {  // Process uses given virtual address
+    struct pcb_t *proc,    // Process uses given virtual address
+    uint32_t access) {     // PTE_* bits to set in the page table entry
 
     /* Offset of the virtual address */
     addr_t offset = get_offset(virtual_addr);
@@ -73,17 +133,24 @@ static int translate(
     addr_t page_index = get_second_lv(virtual_addr);
 
     /* Search in the first level */
-    struct page_table_t *page_table = NULL;
-    page_table = get_page_table(segment_index, proc->seg_table);
-    if (page_table == NULL) {
+    int segment = find_segment(segment_index, proc->seg_table);
+    if (segment < 0) {
         return 0;
     }
+    struct page_table_t *page_table = proc->seg_table->segments[segment].pages_table;
+    if (page_table == NULL) {
+        /* A huge segment maps contiguous frames, no second level */
+        mark_access(&proc->seg_table->segments[segment].flags, access);
+        *physical_addr = ((proc->seg_table->segments[segment].huge_base + page_index) << OFFSET_LEN) | offset;
+        return 1;
+    }
 
     for (uint32_t i = 0; i < page_table->page_count; i++) {
 
         if (page_table->pages[i].v_index == page_index) {
 
             uint32_t physical_index = page_table->pages[i].p_index;
+            mark_access(&page_table->pages[i].flags, access);
             *physical_addr = ((physical_index << OFFSET_LEN) | (offset));
             INFO_PRINT("PID %d: translate 0x%02x -> 0x%02x\n", proc->pid,
                        virtual_addr, *physical_addr);
@@ -93,143 +160,323 @@ static int translate(
     return 0;
 }
 
+static int translate(addr_t virtual_addr, addr_t *physical_addr, struct pcb_t *proc, uint32_t access) {
+    uint64_t start = stats_begin();
+    int ret = do_translate(virtual_addr, physical_addr, proc, access);
+    stats_end(STAT_FN_TRANSLATE, start);
+    return ret;
+}
+
 static void set_mem_stat(uint32_t _mem_stat_index, uint32_t index, uint32_t pid, int32_t next) {
     _mem_stat[_mem_stat_index].proc = pid;
     _mem_stat[_mem_stat_index].index = index;
     _mem_stat[_mem_stat_index].next = next;
+    _mem_stat[_mem_stat_index].ref = 1;
 }
 
 static void unset_mem_stat(uint32_t index) {
     _mem_stat[index].proc = 0;
     _mem_stat[index].index = 0;
     _mem_stat[index].next = -1;
+    _mem_stat[index].ref = 0;
+    _mappers[index].count = 0;
+    _mem_stat[index].shared = 0;
+    _mem_stat[index].huge = 0;
+}
+
+static void push_mapper(uint32_t frame, uint32_t pid) {
+    if (_mappers[frame].count == _mappers[frame].capacity) {
+        _mappers[frame].capacity = _mappers[frame].capacity ? _mappers[frame].capacity * 2 : 4;
+        _mappers[frame].pids = realloc(_mappers[frame].pids, sizeof(uint32_t) * _mappers[frame].capacity);
+    }
+    _mappers[frame].pids[_mappers[frame].count++] = pid;
+}
+
+/* Record that [pid] maps [frame] once more, the caller counts the
+ * reference in _mem_stat */
+static void add_mapper(uint32_t frame, uint32_t pid) {
+    if (_mappers[frame].count == 0) {
+        push_mapper(frame, _mem_stat[frame].proc);
+    }
+    push_mapper(frame, pid);
+}
+
+/* Forget one mapping of [frame] by [pid]. If that was the last one of the
+ * owner, the frame goes to the process which has mapped it the longest */
+static void drop_mapper(uint32_t frame, uint32_t pid) {
+    uint32_t count = _mappers[frame].count;
+    uint32_t *pids = _mappers[frame].pids;
+    uint32_t i = 0;
+    while (i < count && pids[i] != pid) {
+        i++;
+    }
+    if (i == count) {
+        return;
+    }
+    memmove(&pids[i], &pids[i + 1], sizeof(uint32_t) * (count - i - 1));
+    count--;
+    int still_mapped = 0;
+    for (uint32_t j = 0; j < count; j++) {
+        still_mapped |= pids[j] == pid;
+    }
+    if (_mem_stat[frame].proc == pid && !still_mapped && count > 0) {
+        _mem_stat[frame].proc = pids[0];
+    }
+    _mappers[frame].count = count > 1 ? count : 0;
+}
+
+/* Remove the shared segment starting at [frame], if any, once its last
+ * mapping has gone away */
+static void shm_forget(uint32_t frame) {
+    for (uint32_t i = 0; i < MAX_SHM_SEGMENTS; i++) {
+        if (_shm_table[i].key != 0 && _shm_table[i].first_frame == frame) {
+            _shm_table[i].key = 0;
+        }
+    }
 }
 
 static void initialize_page_table(struct page_table_t *page_table) {
     for (uint32_t i = 0; i < MAX_PAGE_PER_SEGMENT; i++) {
         page_table->pages[i].p_index = MAX_PAGE_PER_SEGMENT;
         page_table->pages[i].v_index = MAX_PAGE_PER_SEGMENT;
+        page_table->pages[i].flags = 0;
     }
     page_table->page_count = 0;
 }
 
-addr_t alloc_mem(uint32_t size, struct pcb_t *proc) {
-    INFO_PRINT("PID %d: Allocating %d bytes\n", proc->pid, size);
-    pthread_mutex_lock(&mem_lock);
-    addr_t ret_mem = 0;
-
-    uint32_t required_page_count = (size % PAGE_SIZE) ? size / PAGE_SIZE + 1 : size / PAGE_SIZE; // Number of pages we will use
-    INFO_PRINT("PID %d: Required page count: %d\n", proc->pid, required_page_count);
-    uint32_t *free_frame_physical_indexes = calloc(required_page_count, sizeof(uint32_t)); // allocate array for storing free page index in _mem_stat
-    uint32_t free_frame_available = 0;                                                     // number of free page in _mem_stat found
+/* Collect the indexes of [count] free frames into [frames].
+ * Return 1 on success, 0 if there are not enough free frames */
+static int get_free_frames(uint32_t count, uint32_t *frames) {
+    uint32_t free_frame_available = 0; // number of free page in _mem_stat found
 
     for (uint32_t free_frame_physical_index = 0; free_frame_physical_index < NUM_PAGES; free_frame_physical_index++) { // loop through _mem_stat
-        if (_mem_stat[free_frame_physical_index].proc == 0) {                                                          // if free page
-            free_frame_physical_indexes[free_frame_available] = free_frame_physical_index;                             // add free page index to array
-            free_frame_available++;                                                                                    // increment number of free page
+        if (free_frame_available == count) {                                                                           // if we have enough free page
+            break;
+        }
+        if (_mem_stat[free_frame_physical_index].proc == 0) {                  // if free page
+            frames[free_frame_available] = free_frame_physical_index;          // add free page index to array
+            free_frame_available++;                                            // increment number of free page
         }
+    }
+    return free_frame_available == count;
+}
 
-        if (free_frame_available == required_page_count) { // if we have enough free page
-            break;
+/* Add an entry mapping virtual address [address] to frame [frame] in the
+ * page table of [proc] */
+static void map_page(struct pcb_t *proc, addr_t address, uint32_t frame) {
+    uint32_t current_segment_v_index = get_first_lv(address);
+    uint32_t current_page_v_index = get_second_lv(address);
+
+    struct page_table_t *page_table = get_page_table(current_segment_v_index, proc->seg_table); // page table of the current segment
+
+    if (page_table == NULL) {                                                                        // if we can't find the segment
+        page_table = calloc(1, sizeof(struct page_table_t));                                         // create new page table
+        proc->seg_table->segments[proc->seg_table->segment_count].pages_table = page_table;          // add newly created page table to segment table as new segment
+        proc->seg_table->segments[proc->seg_table->segment_count].v_index = current_segment_v_index; // set v_index of the new segment
+        proc->seg_table->segment_count++;                                                            // increment segment count
+
+        initialize_page_table(page_table); // set all data in page table to default
+    }
+
+    page_table->pages[page_table->page_count].p_index = frame;
+    page_table->pages[page_table->page_count].v_index = current_page_v_index;
+    page_table->pages[page_table->page_count].flags = 0;
+    page_table->page_count++;
+    _page_stat.base++;
+}
+
+/* Map the whole segment starting at [address] to the frames following
+ * [base] with a single entry in the segment table of [proc] */
+static void map_huge(struct pcb_t *proc, addr_t address, uint32_t base) {
+    struct seg_table_t *seg_table = proc->seg_table;
+    seg_table->segments[seg_table->segment_count].v_index = get_first_lv(address);
+    seg_table->segments[seg_table->segment_count].pages_table = NULL;
+    seg_table->segments[seg_table->segment_count].huge_base = base;
+    seg_table->segments[seg_table->segment_count].flags = 0;
+    seg_table->segment_count++;
+    _page_stat.huge++;
+}
+
+/* Give segment [segment] of [proc], mapped huge, a page table of its own
+ * so that its pages can be remapped one by one */
+static void split_huge(struct pcb_t *proc, int segment) {
+    struct page_table_t *page_table = calloc(1, sizeof(struct page_table_t));
+    initialize_page_table(page_table);
+    for (uint32_t i = 0; i < MAX_PAGE_PER_SEGMENT; i++) {
+        page_table->pages[i].v_index = i;
+        page_table->pages[i].p_index = proc->seg_table->segments[segment].huge_base + i;
+        page_table->pages[i].flags = proc->seg_table->segments[segment].flags;
+        _mem_stat[page_table->pages[i].p_index].huge--; // mapped through a page table now
+    }
+    page_table->page_count = MAX_PAGE_PER_SEGMENT;
+    proc->seg_table->segments[segment].pages_table = page_table;
+    _page_stat.split++;
+    _page_stat.base += MAX_PAGE_PER_SEGMENT;
+}
+
+/* First frame of [count] contiguous free frames, or -1 if there is none */
+static int find_free_run(uint32_t count) {
+    uint32_t run = 0;
+    for (uint32_t i = 0; i < NUM_PAGES; i++) {
+        run = _mem_stat[i].proc == 0 ? run + 1 : 0;
+        if (run == count) {
+            return i + 1 - count;
         }
     }
+    return -1;
+}
+
+/* Take [count] free frames and map them at the first free virtual range
+ * of [proc] large enough, chained together in _mem_stat. Private requests
+ * of a segment or more start on a segment boundary, and each of their
+ * full segments is mapped huge while contiguous frames can be found.
+ * Return the virtual address of the first page, or 0 if there is no room.
+ * Must be called with mem_lock held */
+static addr_t map_new_frames(uint32_t count, struct pcb_t *proc, uint32_t shared) {
+    uint32_t *free_frame_physical_indexes = calloc(count, sizeof(uint32_t)); // allocate array for storing free page index in _mem_stat
 
-    const uint32_t start_of_chunk = proc->bp;                                    // start of the chunk we will allocate
-    const uint32_t end_of_chunk = proc->bp + PAGE_SIZE * required_page_count;    // end of the chunk we will allocate
-    if (free_frame_available < required_page_count || end_of_chunk > RAM_SIZE) { // if we don't have enough free page or we will exceed RAM size
+    uint32_t first_page = 0;     // first virtual page of the chunk
+    uint32_t huge_segments = 0;  // leading segments which may be mapped huge
+    if (!shared && count >= MAX_PAGE_PER_SEGMENT) {
+        first_page = vspace_alloc_aligned(proc->vspace, count, MAX_PAGE_PER_SEGMENT);
+        huge_segments = first_page != 0 ? count / MAX_PAGE_PER_SEGMENT : 0;
+    }
+    if (first_page == 0) {
+        first_page = vspace_alloc(proc->vspace, count);
+    }
+    if (first_page == 0) { // if there is no virtual range
         INFO_PRINT("PID %d: Not enough memory\n", proc->pid);
-        pthread_mutex_unlock(&mem_lock);
+        free(free_frame_physical_indexes);
         return 0;
     }
 
-    for (uint32_t i = 0; i < free_frame_available; i++) { // loop through all free page index
+    /* Reserve a run of frames for every huge segment, the remaining pages
+     * take any free frame */
+    uint32_t reserved = 0;
+    for (uint32_t i = 0; i < huge_segments; i++) {
+        int run = find_free_run(MAX_PAGE_PER_SEGMENT);
+        if (run < 0) {
+            break;
+        }
+        for (uint32_t j = 0; j < MAX_PAGE_PER_SEGMENT; j++) {
+            free_frame_physical_indexes[reserved++] = run + j;
+            set_mem_stat(run + j, 0, proc->pid, -1);
+        }
+    }
+    huge_segments = reserved / MAX_PAGE_PER_SEGMENT;
+    if (!get_free_frames(count - reserved, &free_frame_physical_indexes[reserved])) { // if there is not enough free frames
+        INFO_PRINT("PID %d: Not enough memory\n", proc->pid);
+        for (uint32_t i = 0; i < reserved; i++) {
+            unset_mem_stat(free_frame_physical_indexes[i]);
+        }
+        vspace_free(proc->vspace, first_page, count);
+        free(free_frame_physical_indexes);
+        return 0;
+    }
+    const uint32_t start_of_chunk = first_page << OFFSET_LEN; // start of the chunk we will allocate
+    const uint32_t end_of_chunk = start_of_chunk + PAGE_SIZE * count; // end of the chunk we will allocate
+
+    for (uint32_t i = 0; i < count; i++) { // loop through all free page index
         const uint32_t free_frame_physical_index = free_frame_physical_indexes[i];
 
         // _mem_stat handling
-        set_mem_stat(free_frame_physical_index, i, proc->pid, i == free_frame_available - 1 ? (int32_t)-1 : (int32_t)free_frame_physical_indexes[i + 1]);
+        set_mem_stat(free_frame_physical_index, i, proc->pid, i == count - 1 ? (int32_t)-1 : (int32_t)free_frame_physical_indexes[i + 1]);
+        _mem_stat[free_frame_physical_index].shared = shared;
+        _mem_stat[free_frame_physical_index].huge = i < huge_segments * MAX_PAGE_PER_SEGMENT;
         INFO_PRINT("PID %d: Free page physical index: %d\n", proc->pid, free_frame_physical_index);
         INFO_PRINT("PID %d: Free page info: proc: %d, index: %d, next: %d\n", proc->pid, _mem_stat[free_frame_physical_index].proc, _mem_stat[free_frame_physical_index].index, _mem_stat[free_frame_physical_index].next);
 
-        uint32_t current_address = start_of_chunk + i * PAGE_SIZE; // virtual address of the current page
-        uint32_t current_segment_v_index = get_first_lv(current_address);
-        uint32_t current_page_v_index = get_second_lv(current_address);
-
-        struct page_table_t *page_table = NULL; // page table of the current segment
-
-        for (uint32_t segment_index = 0; segment_index < proc->seg_table->segment_count; segment_index++) { // loop through all segment
-            if (proc->seg_table->segments[segment_index].v_index == current_segment_v_index) {              // if we found the segment with v_index = current_segment_v_index
-                page_table = proc->seg_table->segments[segment_index].pages_table;
-                break;
-            }
+        if (i >= huge_segments * MAX_PAGE_PER_SEGMENT) {
+            map_page(proc, start_of_chunk + i * PAGE_SIZE, free_frame_physical_index); // virtual address of the current page
+        } else if (i % MAX_PAGE_PER_SEGMENT == 0) {
+            map_huge(proc, start_of_chunk + i * PAGE_SIZE, free_frame_physical_index);
         }
-
-        if (page_table == NULL) {                                                                        // if we can't find the segment
-            page_table = calloc(1, sizeof(struct page_table_t));                                         // create new page table
-            proc->seg_table->segments[proc->seg_table->segment_count].pages_table = page_table;          // add newly created page table to segment table as new segment
-            proc->seg_table->segments[proc->seg_table->segment_count].v_index = current_segment_v_index; // set v_index of the new segment
-            proc->seg_table->segment_count++;                                                            // increment segment count
-
-            initialize_page_table(page_table); // set all data in page table to default
-        }
-
-        page_table->pages[page_table->page_count].p_index = free_frame_physical_index;
-        page_table->pages[page_table->page_count].v_index = current_page_v_index;
-        page_table->page_count++;
     }
+    free(free_frame_physical_indexes);
 
     /* We could allocate new memory region to the process */
-    ret_mem = proc->bp;      // return virtual address of the allocated memory
-    proc->bp = end_of_chunk; // set new value of bp
+    if (end_of_chunk > proc->bp) {
+        proc->bp = end_of_chunk; // bp only records the highest address ever used
+    }
+    return start_of_chunk; // return virtual address of the allocated memory
+}
+
+static addr_t do_alloc_mem(uint32_t size, struct pcb_t *proc) {
+    INFO_PRINT("PID %d: Allocating %d bytes\n", proc->pid, size);
+    stats_lock(&mem_lock, STAT_LOCK_MEM);
+
+    uint32_t required_page_count = (size % PAGE_SIZE) ? size / PAGE_SIZE + 1 : size / PAGE_SIZE; // Number of pages we will use
+    INFO_PRINT("PID %d: Required page count: %d\n", proc->pid, required_page_count);
     /* Update status of physical pages which will be allocated
      * to [proc] in _mem_stat. Tasks to do:
      * 	- Update [proc], [index], and [next] field
      * 	- Add entries to segment table page tables of [proc]
      * 	  to ensure accesses to allocated memory slot is
      * 	  valid. */
+    addr_t ret_mem = map_new_frames(required_page_count, proc, 0);
 
 #ifdef DEBUG
     // dump();
 #endif
-    pthread_mutex_unlock(&mem_lock);
+    stats_unlock(&mem_lock, STAT_LOCK_MEM);
     return ret_mem;
 }
 
-void adjust_bp(struct pcb_t *proc) {
-    if (proc->seg_table->segment_count == 0) {
-        proc->bp = 1024;
-        return;
-    }
-    uint32_t max_segment_v_index = 0;
-    uint32_t max_v_index_segment_index = 0;
-    for (uint32_t i = 0; i < proc->seg_table->segment_count; i++) {
-        if (proc->seg_table->segments[i].v_index > max_segment_v_index) {
-            max_segment_v_index = proc->seg_table->segments[i].v_index;
-            max_v_index_segment_index = i;
-        }
-    }
-    uint32_t max_page_v_index = 0;
-    for (uint32_t i = 0; i < proc->seg_table->segments[max_v_index_segment_index].pages_table->page_count; i++) {
-        if (proc->seg_table->segments[max_v_index_segment_index].pages_table->pages[i].v_index > max_page_v_index) {
-            max_page_v_index = proc->seg_table->segments[max_v_index_segment_index].pages_table->pages[i].v_index;
+addr_t alloc_mem(uint32_t size, struct pcb_t *proc) {
+    uint64_t start = stats_begin();
+    addr_t ret = do_alloc_mem(size, proc);
+    stats_end(STAT_FN_ALLOC, start);
+    return ret;
+}
+
+/* Drop a mapping of [frame] by [pid], releasing it with the last one */
+static void release_frame(uint32_t frame, uint32_t pid) {
+    if (_mem_stat[frame].ref > 1) { // if another process still maps this frame
+        _mem_stat[frame].ref--;     // just drop our reference
+        drop_mapper(frame, pid);
+    } else {
+        if (_mem_stat[frame].shared) {
+            shm_forget(frame);
         }
+        unset_mem_stat(frame); // unset the current page in _mem_stat
     }
-
-    proc->bp = ((max_v_index_segment_index << (OFFSET_LEN + PAGE_LEN)) | (max_page_v_index << OFFSET_LEN)) + PAGE_SIZE;
 }
 
-int free_mem(addr_t address, struct pcb_t *proc) {
-    pthread_mutex_lock(&mem_lock);
+static int do_free_mem(addr_t address, struct pcb_t *proc) {
+    stats_lock(&mem_lock, STAT_LOCK_MEM);
 
     uint32_t current_address = address;                                   // virtual address of the current page we want to free
+    uint32_t freed_pages = 0;                                             // pages to give back to the virtual space
+    int ret = 1;
     bool hasNext = true;                                                  // flag to check if we have next page to free
     while (hasNext) {                                                     // while the current page have next page
         uint32_t current_segment_v_index = get_first_lv(current_address); // get current segment index
         uint32_t current_page_v_index = get_second_lv(current_address);   // get current page index
 
-        struct page_table_t *page_table = get_page_table(current_segment_v_index, proc->seg_table); // get page table of the current segment
-        if (page_table == NULL) {                                                                   // if we can't find the segment (aka we want to free invalid memory)
-            pthread_mutex_unlock(&mem_lock);                                                        // bail out
-            return 0;
+        int segment = find_segment(current_segment_v_index, proc->seg_table); // get the current segment
+        if (segment < 0) {                                                    // if we can't find the segment (aka we want to free invalid memory)
+            ret = 0;                                                          // bail out
+            break;
+        }
+        struct page_table_t *page_table = proc->seg_table->segments[segment].pages_table; // get page table of the current segment
+        if (page_table == NULL) {           // a huge segment is freed as a whole
+            if (current_page_v_index != 0) { // which must start at its first page
+                ret = 0;
+                break;
+            }
+            uint32_t base = proc->seg_table->segments[segment].huge_base;
+            hasNext = _mem_stat[base + MAX_PAGE_PER_SEGMENT - 1].next != -1;
+            for (uint32_t i = 0; i < MAX_PAGE_PER_SEGMENT; i++) {
+                _mem_stat[base + i].huge--;
+                release_frame(base + i, proc->pid);
+            }
+            for (uint32_t j = segment; j < proc->seg_table->segment_count - 1; j++) {
+                proc->seg_table->segments[j] = proc->seg_table->segments[j + 1];
+            }
+            proc->seg_table->segment_count--;
+            freed_pages += MAX_PAGE_PER_SEGMENT;
+            current_address += PAGE_SIZE * MAX_PAGE_PER_SEGMENT;
+            continue;
         }
 
         uint32_t current_page_index = 32;                               // index of the current page in the page table
@@ -239,14 +486,14 @@ int free_mem(addr_t address, struct pcb_t *proc) {
                 break;
             }
         }
-        if (current_page_index == 32) {      // if we can't find the page
-            pthread_mutex_unlock(&mem_lock); // bail out
-            return 0;
+        if (current_page_index == 32) { // if we can't find the page
+            ret = 0;                    // bail out
+            break;
         }
 
         uint32_t frame_index = page_table->pages[current_page_index].p_index; // get the index in _mem_stat of the current page
         hasNext = _mem_stat[frame_index].next != -1;                          // check if the current page have next page to free
-        unset_mem_stat(frame_index);                                          // unset the current page in _mem_stat
+        release_frame(frame_index, proc->pid);
 
         page_table->pages[current_page_index].p_index = 32; // set the current page to invalid
         page_table->pages[current_page_index].v_index = 32; // set the current page to invalid
@@ -276,20 +523,28 @@ int free_mem(addr_t address, struct pcb_t *proc) {
             }
         }
 
-        adjust_bp(proc);
+        freed_pages++;
         current_address += PAGE_SIZE; // go to next page in chunk
     }
+    vspace_free(proc->vspace, address >> OFFSET_LEN, freed_pages); // the range can be reused by later allocations
 #ifdef DEBUG
     // dump();
 #endif
-    pthread_mutex_unlock(&mem_lock);
+    stats_unlock(&mem_lock, STAT_LOCK_MEM);
 
-    return 1;
+    return ret;
+}
+
+int free_mem(addr_t address, struct pcb_t *proc) {
+    uint64_t start = stats_begin();
+    int ret = do_free_mem(address, proc);
+    stats_end(STAT_FN_FREE, start);
+    return ret;
 }
 
 int read_mem(addr_t address, struct pcb_t *proc, BYTE *data) {
     addr_t physical_addr;
-    if (translate(address, &physical_addr, proc)) {
+    if (translate(address, &physical_addr, proc, PTE_ACCESSED)) {
         *data = _ram[physical_addr];
         INFO_PRINT("PID: %d read at address 0x%x, got data 0x%02x\n", proc->pid, address, *data);
         return 0;
@@ -299,10 +554,162 @@ int read_mem(addr_t address, struct pcb_t *proc, BYTE *data) {
     }
 }
 
+void fork_mem(struct pcb_t *parent, struct pcb_t *child) {
+    stats_lock(&mem_lock, STAT_LOCK_MEM);
+    memcpy(child->seg_table, parent->seg_table, sizeof(struct seg_table_t));
+    child->vspace = vspace_clone(parent->vspace);
+    for (uint32_t i = 0; i < child->seg_table->segment_count; i++) {
+        if (child->seg_table->segments[i].pages_table == NULL) {
+            /* Huge segments are shared as a whole until written */
+            for (uint32_t j = 0; j < MAX_PAGE_PER_SEGMENT; j++) {
+                _mem_stat[child->seg_table->segments[i].huge_base + j].ref++;
+                _mem_stat[child->seg_table->segments[i].huge_base + j].huge++;
+                add_mapper(child->seg_table->segments[i].huge_base + j, child->pid);
+            }
+            child->seg_table->segments[i].flags = 0;
+            continue;
+        }
+        struct page_table_t *page_table = malloc(sizeof(struct page_table_t));
+        memcpy(page_table, parent->seg_table->segments[i].pages_table, sizeof(struct page_table_t));
+        child->seg_table->segments[i].pages_table = page_table;
+        for (uint32_t j = 0; j < page_table->page_count; j++) {
+            _mem_stat[page_table->pages[j].p_index].ref++;
+            add_mapper(page_table->pages[j].p_index, child->pid);
+            page_table->pages[j].flags = 0; // the child has not touched anything yet
+        }
+    }
+    stats_unlock(&mem_lock, STAT_LOCK_MEM);
+}
+
+addr_t shm_create(uint32_t key, uint32_t size, struct pcb_t *proc) {
+    stats_lock(&mem_lock, STAT_LOCK_MEM);
+    int slot = -1;
+    for (int i = 0; i < MAX_SHM_SEGMENTS; i++) {
+        if (_shm_table[i].key == key) {
+            INFO_PRINT("PID %d: Shared segment %d already exists\n", proc->pid, key);
+            stats_unlock(&mem_lock, STAT_LOCK_MEM);
+            return 0;
+        }
+        if (_shm_table[i].key == 0 && slot == -1) {
+            slot = i;
+        }
+    }
+    uint32_t page_count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    addr_t address = 0;
+    if (key != 0 && slot != -1 && page_count > 0) {
+        address = map_new_frames(page_count, proc, 1);
+    }
+    if (address != 0) {
+        addr_t physical_addr = 0;
+        do_translate(address, &physical_addr, proc, 0);
+        _shm_table[slot].key = key;
+        _shm_table[slot].first_frame = physical_addr >> OFFSET_LEN;
+        _shm_table[slot].page_count = page_count;
+    }
+    stats_unlock(&mem_lock, STAT_LOCK_MEM);
+    return address;
+}
+
+addr_t shm_attach(uint32_t key, struct pcb_t *proc) {
+    stats_lock(&mem_lock, STAT_LOCK_MEM);
+    addr_t address = 0;
+    for (int i = 0; i < MAX_SHM_SEGMENTS; i++) {
+        if (key == 0 || _shm_table[i].key != key) {
+            continue;
+        }
+        uint32_t first_page = vspace_alloc(proc->vspace, _shm_table[i].page_count);
+        if (first_page == 0) {
+            break;
+        }
+        address = first_page << OFFSET_LEN;
+        int frame = _shm_table[i].first_frame;
+        for (uint32_t j = 0; j < _shm_table[i].page_count; j++) {
+            map_page(proc, address + j * PAGE_SIZE, frame);
+            _mem_stat[frame].ref++;
+            add_mapper(frame, proc->pid);
+            frame = _mem_stat[frame].next;
+        }
+        if (address + PAGE_SIZE * _shm_table[i].page_count > proc->bp) {
+            proc->bp = address + PAGE_SIZE * _shm_table[i].page_count;
+        }
+        break;
+    }
+    stats_unlock(&mem_lock, STAT_LOCK_MEM);
+    return address;
+}
+
+/* Frame mapped by [proc] at the page of [address], -1 if there is none */
+static int frame_at(addr_t address, struct pcb_t *proc) {
+    addr_t physical_addr;
+    if (!do_translate(address, &physical_addr, proc, 0)) {
+        return -1;
+    }
+    return physical_addr >> OFFSET_LEN;
+}
+
+/* Give [proc] a private copy of the shared frame mapped at [address].
+ * Return 1 and write the new physical address to [physical_addr] on
+ * success, 0 if there is no free frame left */
+static int cow_fault(addr_t address, addr_t *physical_addr, struct pcb_t *proc) {
+    stats_lock(&mem_lock, STAT_LOCK_MEM);
+    int segment = find_segment(get_first_lv(address), proc->seg_table);
+    if (proc->seg_table->segments[segment].pages_table == NULL) {
+        split_huge(proc, segment); // only the written page gets copied
+    }
+    struct page_table_t *page_table = proc->seg_table->segments[segment].pages_table;
+    uint32_t i = 0;
+    while (page_table->pages[i].v_index != get_second_lv(address)) {
+        i++;
+    }
+    uint32_t old_frame = page_table->pages[i].p_index;
+    if (_mem_stat[old_frame].ref > 1) { // the other processes may have let it go meanwhile
+        uint32_t new_frame = 0;
+        while (new_frame < NUM_PAGES && _mem_stat[new_frame].proc != 0) {
+            new_frame++;
+        }
+        if (new_frame == NUM_PAGES) {
+            INFO_PRINT("PID %d: Not enough memory to copy frame %d\n", proc->pid, old_frame);
+            stats_unlock(&mem_lock, STAT_LOCK_MEM);
+            return 0;
+        }
+        memcpy(&_ram[new_frame << OFFSET_LEN], &_ram[old_frame << OFFSET_LEN], PAGE_SIZE);
+        addr_t page = address & ~(addr_t)(PAGE_SIZE - 1);
+        /* The copy takes the place of the original in the list of pages of
+         * the writer. A previous page still shared keeps pointing to the
+         * original for the other processes, it is relinked once copied */
+        int next = _mem_stat[old_frame].next;
+        if (next != -1 && frame_at(page + PAGE_SIZE, proc) != -1) {
+            next = frame_at(page + PAGE_SIZE, proc);
+        }
+        set_mem_stat(new_frame, _mem_stat[old_frame].index, proc->pid, next);
+        int prev = _mem_stat[old_frame].index > 0 ? frame_at(page - PAGE_SIZE, proc) : -1;
+        if (prev != -1 && _mem_stat[prev].ref == 1 && _mem_stat[prev].next == (int)old_frame) {
+            _mem_stat[prev].next = new_frame;
+        }
+        _mem_stat[old_frame].ref--;
+        drop_mapper(old_frame, proc->pid); // the original stays with the others
+        page_table->pages[i].p_index = new_frame;
+        INFO_PRINT("PID %d: copied frame %d to %d on write\n", proc->pid, old_frame, new_frame);
+    }
+    *physical_addr = (page_table->pages[i].p_index << OFFSET_LEN) | get_offset(address);
+    stats_unlock(&mem_lock, STAT_LOCK_MEM);
+    return 1;
+}
+
 int write_mem(addr_t address, struct pcb_t *proc, BYTE data) {
     addr_t physical_addr;
-    if (translate(address, &physical_addr, proc)) {
+    if (translate(address, &physical_addr, proc, PTE_ACCESSED | PTE_DIRTY)) {
+        /* Frames of shared segments are never copied. Any other frame only
+         * gains references when a process mapping it forks, so a count of 1
+         * seen without the lock for such a frame cannot be stale: this
+         * process is its only mapper */
+        if (__atomic_load_n(&_mem_stat[physical_addr >> OFFSET_LEN].ref, __ATOMIC_ACQUIRE) > 1 &&
+            !_mem_stat[physical_addr >> OFFSET_LEN].shared &&
+            !cow_fault(address, &physical_addr, proc)) {
+            return 1;
+        }
         _ram[physical_addr] = data;
+        __atomic_store_n(&_dirty[physical_addr >> OFFSET_LEN], 1, __ATOMIC_RELAXED);
         INFO_PRINT("PID: %d wrote at address 0x%x, with data 0x%02x\n", proc->pid, address, data);
         return 0;
     } else {
@@ -311,26 +718,392 @@ int write_mem(addr_t address, struct pcb_t *proc, BYTE data) {
     }
 }
 
-void dump(void) {
-    int i;
-    for (i = 0; i < NUM_PAGES; i++) {
-        if (_mem_stat[i].proc != 0) {
-            printf("%03d: ", i);
-            printf("%05x-%05x - PID: %02d (idx %03d, nxt: %03d)\n",
-                   i << OFFSET_LEN,
-                   ((i + 1) << OFFSET_LEN) - 1,
-                   _mem_stat[i].proc,
-                   _mem_stat[i].index,
-                   _mem_stat[i].next);
-            int j;
-            for (j = i << OFFSET_LEN;
-                 j < ((i + 1) << OFFSET_LEN) - 1;
-                 j++) {
-
-                if (_ram[j] != 0) {
-                    printf("\t%05x: %02x\n", j, _ram[j]);
+/* Offset of the first non-zero byte of [data] at or after [from], or
+ * [size] if there is none. Whole words are compared while they are zero */
+static uint32_t next_nonzero(const BYTE *data, uint32_t from, uint32_t size) {
+    while (from < size && from % sizeof(uint64_t) != 0 && data[from] == 0) {
+        from++;
+    }
+    while (from + sizeof(uint64_t) <= size) {
+        uint64_t word;
+        memcpy(&word, &data[from], sizeof(word));
+        if (word != 0) {
+            break;
+        }
+        from += sizeof(uint64_t);
+    }
+    while (from < size && data[from] == 0) {
+        from++;
+    }
+    return from;
+}
+
+/* Check whether every byte of frame [frame] is zero */
+static int frame_is_zero(uint32_t frame) {
+    return next_nonzero(&_ram[frame << OFFSET_LEN], 0, PAGE_SIZE) == PAGE_SIZE;
+}
+
+void harvest_pages(struct pcb_t *proc, uint32_t *accessed, uint32_t *dirty) {
+    *accessed = 0;
+    *dirty = 0;
+    for (uint32_t i = 0; i < proc->seg_table->segment_count; i++) {
+        struct page_table_t *page_table = proc->seg_table->segments[i].pages_table;
+        if (page_table == NULL) {
+            /* The bits of a huge segment stand for all of its pages */
+            uint32_t flags = proc->seg_table->segments[i].flags;
+            uint32_t base = proc->seg_table->segments[i].huge_base;
+            for (uint32_t j = 0; j < MAX_PAGE_PER_SEGMENT; j++) {
+                _heat[base + j].accessed += (flags & PTE_ACCESSED) != 0;
+                _heat[base + j].dirty += (flags & PTE_DIRTY) != 0;
+            }
+            *accessed += flags & PTE_ACCESSED ? MAX_PAGE_PER_SEGMENT : 0;
+            *dirty += flags & PTE_DIRTY ? MAX_PAGE_PER_SEGMENT : 0;
+            proc->seg_table->segments[i].flags = 0;
+            continue;
+        }
+        for (uint32_t j = 0; j < page_table->page_count; j++) {
+            uint32_t flags = page_table->pages[j].flags;
+            uint32_t frame = page_table->pages[j].p_index;
+            if (flags & PTE_ACCESSED) {
+                (*accessed)++;
+                _heat[frame].accessed++;
+            }
+            if (flags & PTE_DIRTY) {
+                (*dirty)++;
+                _heat[frame].dirty++;
+            }
+            page_table->pages[j].flags = 0;
+        }
+    }
+}
+
+void dump_heat(FILE *file) {
+    fprintf(file, "frame,pid,accessed,dirty\n");
+    for (uint32_t i = 0; i < NUM_PAGES; i++) {
+        if (_heat[i].accessed != 0) {
+            fprintf(file, "%u,%u,%u,%u\n", i, _mem_stat[i].proc, _heat[i].accessed, _heat[i].dirty);
+        }
+    }
+}
+
+uint32_t mem_pages(struct pcb_t *proc) {
+    uint32_t pages = 0;
+    for (uint32_t i = 0; i < proc->seg_table->segment_count; i++) {
+        const struct page_table_t *page_table = proc->seg_table->segments[i].pages_table;
+        pages += page_table == NULL ? MAX_PAGE_PER_SEGMENT : page_table->page_count;
+    }
+    return pages;
+}
+
+/* Length of the longest run of free frames */
+static uint32_t largest_free_run(void) {
+    uint32_t largest = 0;
+    uint32_t run = 0;
+    for (uint32_t i = 0; i < NUM_PAGES; i++) {
+        run = _mem_stat[i].proc == 0 ? run + 1 : 0;
+        if (run > largest) {
+            largest = run;
+        }
+    }
+    return largest;
+}
+
+/* Move frame [from] to the free frame [to]: its contents, its _mem_stat
+ * entry, the links of the chains going through it and the page table
+ * entries of [procs] mapping it */
+static void move_frame(uint32_t from, uint32_t to, struct pcb_t **procs, int count) {
+    memcpy(&_ram[to << OFFSET_LEN], &_ram[from << OFFSET_LEN], PAGE_SIZE);
+    memset(&_ram[from << OFFSET_LEN], 0, PAGE_SIZE);
+    _mem_stat[to] = _mem_stat[from];
+    uint32_t *spare = _mappers[to].pids; // [to] is free, keep its buffer
+    uint32_t spare_capacity = _mappers[to].capacity;
+    _mappers[to] = _mappers[from];
+    _mappers[from].pids = spare;
+    _mappers[from].capacity = spare_capacity;
+    unset_mem_stat(from);
+    _dirty[to] = _dirty[from];
+    _dirty[from] = 0;
+    _heat[to] = _heat[from];
+    memset(&_heat[from], 0, sizeof(_heat[from]));
+
+    /* Copies made on write keep the next link of the original, so a frame
+     * may have several predecessors */
+    for (uint32_t i = 0; i < NUM_PAGES; i++) {
+        if (_mem_stat[i].proc != 0 && _mem_stat[i].next == (int)from) {
+            _mem_stat[i].next = to;
+        }
+    }
+    for (uint32_t i = 0; i < MAX_SHM_SEGMENTS; i++) {
+        if (_shm_table[i].key != 0 && _shm_table[i].first_frame == from) {
+            _shm_table[i].first_frame = to;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        struct seg_table_t *seg_table = procs[i]->seg_table;
+        for (uint32_t j = 0; j < seg_table->segment_count; j++) {
+            struct page_table_t *page_table = seg_table->segments[j].pages_table;
+            for (uint32_t k = 0; page_table != NULL && k < page_table->page_count; k++) {
+                if (page_table->pages[k].p_index == from) {
+                    page_table->pages[k].p_index = to;
                 }
             }
         }
     }
 }
+
+static uint32_t _compacted = 0; // Frames moved by the pass in progress
+
+void compact_mem(uint32_t budget, struct pcb_t **procs, int count) {
+    stats_lock(&mem_lock, STAT_LOCK_MEM);
+    /* Processes allocate between two slots, so both runs are measured in
+     * the slot ending the pass. The end is detected as soon as the last
+     * frame has moved */
+    uint32_t run_before = largest_free_run();
+    uint32_t low = 0;
+    uint32_t high = NUM_PAGES;
+    uint32_t moves = 0;
+    while (1) {
+        /* Fill the lowest free frame with the highest frame in use */
+        while (low < NUM_PAGES && _mem_stat[low].proc != 0) {
+            low++;
+        }
+        do {
+            high--;
+        } while (high > low && (_mem_stat[high].proc == 0 || _mem_stat[high].huge));
+        if (high <= low || moves == budget) {
+            break;
+        }
+        move_frame(high, low, procs, count);
+        moves++;
+    }
+    _compacted += moves;
+    if (high <= low && _compacted > 0) {
+        printf("\tCompaction moved %u frames, largest free run %u -> %u frames\n",
+               _compacted, run_before, largest_free_run());
+        _compacted = 0;
+    }
+    stats_unlock(&mem_lock, STAT_LOCK_MEM);
+}
+
+void report_pages(void) {
+    if (_page_stat.huge == 0) {
+        return;
+    }
+    printf("\nPAGES: %lu huge segments (%lu frames), %lu base pages, %lu huge segments split\n",
+           (unsigned long)_page_stat.huge,
+           (unsigned long)_page_stat.huge * MAX_PAGE_PER_SEGMENT,
+           (unsigned long)_page_stat.base,
+           (unsigned long)_page_stat.split);
+}
+
+#define DUMP_BUFFER_SIZE (1 << 16)
+
+/* Output of the dump functions is formatted here and written to [file]
+ * in large blocks */
+static struct {
+    FILE *file;
+    size_t len;
+    char data[DUMP_BUFFER_SIZE];
+} _dump_buf;
+
+static void dump_flush(void) {
+    if (_dump_buf.len != 0 && fwrite(_dump_buf.data, 1, _dump_buf.len, _dump_buf.file) != _dump_buf.len) {
+        printf("Cannot write memory dump\n");
+        exit(1);
+    }
+    _dump_buf.len = 0;
+}
+
+static void dump_put(const void *data, size_t size) {
+    if (_dump_buf.len + size > DUMP_BUFFER_SIZE) {
+        dump_flush();
+    }
+    memcpy(&_dump_buf.data[_dump_buf.len], data, size);
+    _dump_buf.len += size;
+}
+
+/* Append [value] in hexadecimal, zero padded to [width] digits */
+static void dump_hex(uint32_t value, int width) {
+    static const char digits[] = "0123456789abcdef";
+    char text[8];
+    int len = 0;
+    do {
+        text[sizeof(text) - 1 - len++] = digits[value & 0xf];
+        value >>= 4;
+    } while (value != 0);
+    while (len < width) {
+        text[sizeof(text) - 1 - len++] = '0';
+    }
+    dump_put(&text[sizeof(text) - len], len);
+}
+
+static void dump_frame(uint32_t frame) {
+    char header[64];
+    int len = snprintf(header, sizeof(header), "%03d: %05x-%05x - PID: %02d (idx %03d, nxt: %03d)\n",
+                       frame,
+                       frame << OFFSET_LEN,
+                       ((frame + 1) << OFFSET_LEN) - 1,
+                       _mem_stat[frame].proc,
+                       _mem_stat[frame].index,
+                       _mem_stat[frame].next);
+    dump_put(header, len);
+
+    const BYTE *data = &_ram[frame << OFFSET_LEN];
+    for (uint32_t j = next_nonzero(data, 0, PAGE_SIZE); j < PAGE_SIZE; j = next_nonzero(data, j + 1, PAGE_SIZE)) {
+        dump_put("\t", 1);
+        dump_hex((frame << OFFSET_LEN) + j, 5);
+        dump_put(": ", 2);
+        dump_hex((uint32_t)(int)data[j], 2); // same digits as printf("%02x") of a BYTE
+        dump_put("\n", 1);
+    }
+}
+
+/* Print the frames in use, or only the dirty ones if [only_dirty] is set,
+ * and clear their dirty bits */
+static void dump_frames(int only_dirty) {
+    _dump_buf.file = stdout;
+    for (uint32_t i = 0; i < NUM_PAGES; i++) {
+        if (_mem_stat[i].proc != 0 && (!only_dirty || _dirty[i])) {
+            dump_frame(i);
+        }
+    }
+    memset(_dirty, 0, sizeof(_dirty));
+    dump_flush();
+}
+
+void dump(void) {
+    dump_frames(0);
+}
+
+void dump_dirty(void) {
+    dump_frames(1);
+}
+
+void dump_image(FILE *file) {
+    _dump_buf.file = file;
+    uint32_t header[3] = {DUMP_IMAGE_MAGIC, NUM_PAGES, PAGE_SIZE};
+    dump_put(header, sizeof(header));
+    for (uint32_t i = 0; i < NUM_PAGES; i++) {
+        if (_mem_stat[i].proc == 0) {
+            continue;
+        }
+        int32_t frame[4] = {i, _mem_stat[i].proc, _mem_stat[i].index, _mem_stat[i].next};
+        dump_put(frame, sizeof(frame));
+        /* Runs of bytes separated by at least a word of zeros */
+        const BYTE *data = &_ram[i << OFFSET_LEN];
+        uint32_t start = next_nonzero(data, 0, PAGE_SIZE);
+        while (start < PAGE_SIZE) {
+            uint32_t end = start + 1;
+            uint32_t next = next_nonzero(data, end, PAGE_SIZE);
+            while (next < PAGE_SIZE && next - end < sizeof(uint64_t)) {
+                end = next + 1;
+                next = next_nonzero(data, end, PAGE_SIZE);
+            }
+            uint16_t run[2] = {start, end - start};
+            dump_put(run, sizeof(run));
+            dump_put(&data[start], end - start);
+            start = next;
+        }
+        uint16_t last[2] = {PAGE_SIZE, 0};
+        dump_put(last, sizeof(last));
+    }
+    int32_t last[4] = {-1, 0, 0, 0};
+    dump_put(last, sizeof(last));
+    dump_flush();
+}
+
+void save_mem(FILE *file) {
+    ckpt_write(file, _mem_stat, sizeof(_mem_stat));
+    ckpt_write(file, _shm_table, sizeof(_shm_table));
+    ckpt_write(file, _dirty, sizeof(_dirty));
+    ckpt_write(file, _heat, sizeof(_heat));
+    ckpt_write(file, &_page_stat, sizeof(_page_stat));
+    ckpt_write_u32(file, _compacted);
+    for (uint32_t i = 0; i < NUM_PAGES; i++) {
+        ckpt_write_u32(file, _mappers[i].count);
+        ckpt_write(file, _mappers[i].pids, sizeof(uint32_t) * _mappers[i].count);
+    }
+    uint32_t used_frames = 0;
+    for (uint32_t i = 0; i < NUM_PAGES; i++) {
+        if (!frame_is_zero(i)) {
+            used_frames++;
+        }
+    }
+    ckpt_write_u32(file, used_frames);
+    for (uint32_t i = 0; i < NUM_PAGES; i++) {
+        if (!frame_is_zero(i)) {
+            ckpt_write_u32(file, i);
+            ckpt_write(file, &_ram[i << OFFSET_LEN], PAGE_SIZE);
+        }
+    }
+}
+
+void restore_mem(FILE *file) {
+    ckpt_read(file, _mem_stat, sizeof(_mem_stat));
+    ckpt_read(file, _shm_table, sizeof(_shm_table));
+    ckpt_read(file, _dirty, sizeof(_dirty));
+    ckpt_read(file, _heat, sizeof(_heat));
+    ckpt_read(file, &_page_stat, sizeof(_page_stat));
+    _compacted = ckpt_read_u32(file);
+    for (uint32_t i = 0; i < NUM_PAGES; i++) {
+        uint32_t count = ckpt_read_u32(file);
+        _mappers[i].count = 0;
+        for (uint32_t j = 0; j < count; j++) {
+            push_mapper(i, ckpt_read_u32(file));
+        }
+    }
+    memset(_ram, 0, sizeof(BYTE) * RAM_SIZE);
+    uint32_t used_frames = ckpt_read_u32(file);
+    for (uint32_t i = 0; i < used_frames; i++) {
+        uint32_t frame = ckpt_read_u32(file);
+        if (frame >= NUM_PAGES) {
+            printf("Checkpoint is corrupted\n");
+            exit(1);
+        }
+        ckpt_read(file, &_ram[frame << OFFSET_LEN], PAGE_SIZE);
+    }
+}
+
+void save_seg_table(FILE *file, const struct seg_table_t *seg_table) {
+    ckpt_write_u32(file, seg_table->segment_count);
+    for (uint32_t i = 0; i < seg_table->segment_count; i++) {
+        const struct page_table_t *page_table = seg_table->segments[i].pages_table;
+        ckpt_write_u32(file, seg_table->segments[i].v_index);
+        ckpt_write_u32(file, page_table == NULL);
+        if (page_table == NULL) {
+            ckpt_write_u32(file, seg_table->segments[i].huge_base);
+            ckpt_write_u32(file, seg_table->segments[i].flags);
+            continue;
+        }
+        ckpt_write_u32(file, page_table->page_count);
+        for (uint32_t j = 0; j < page_table->page_count; j++) {
+            ckpt_write_u32(file, page_table->pages[j].v_index);
+            ckpt_write_u32(file, page_table->pages[j].p_index);
+            ckpt_write_u32(file, page_table->pages[j].flags);
+        }
+    }
+}
+
+struct seg_table_t *restore_seg_table(FILE *file) {
+    struct seg_table_t *seg_table = calloc(1, sizeof(struct seg_table_t));
+    seg_table->segment_count = ckpt_read_u32(file);
+    for (uint32_t i = 0; i < seg_table->segment_count; i++) {
+        seg_table->segments[i].v_index = ckpt_read_u32(file);
+        if (ckpt_read_u32(file)) {
+            seg_table->segments[i].pages_table = NULL;
+            seg_table->segments[i].huge_base = ckpt_read_u32(file);
+            seg_table->segments[i].flags = ckpt_read_u32(file);
+            continue;
+        }
+        struct page_table_t *page_table = calloc(1, sizeof(struct page_table_t));
+        initialize_page_table(page_table);
+        seg_table->segments[i].pages_table = page_table;
+        page_table->page_count = ckpt_read_u32(file);
+        for (uint32_t j = 0; j < page_table->page_count; j++) {
+            page_table->pages[j].v_index = ckpt_read_u32(file);
+            page_table->pages[j].p_index = ckpt_read_u32(file);
+            page_table->pages[j].flags = ckpt_read_u32(file);
+        }
+    }
+    return seg_table;
+}
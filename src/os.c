@@ -1,147 +1,449 @@
+#include "checkpoint.h"
 #include "cpu.h"
 #include "loader.h"
 #include "mem.h"
 #include "sched.h"
+#include "stats.h"
 #include "timer.h"
+#include "vspace.h"
 
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 static int time_slot;
 static int num_cpus;
 static int done = 0;
 
+#define LD_PATH_MAX 512
+
+/* Arrivals are streamed from the configure file, only the next record
+ * is kept in memory no matter how long the trace is */
 static struct ld_args {
-    char **path;
-    unsigned long *start_time;
-} ld_processes;
+    FILE *file;            // Configure file, positioned after the pending record
+    const char *config;    // Path of the configure file
+    const char *dir;       // Directory of the process descriptions
+    long offset;           // Offset of the pending record in [file]
+    int line;              // Line of the last record read from [file]
+    int pending;           // The fields below hold a record not loaded yet
+    char path[LD_PATH_MAX];
+    unsigned long start_time;
+    uint32_t deadline; // Relative deadline, 0 for the priority class
+} ld_processes = {.dir = "input/proc/"};
 int num_processes;
+static int ld_next = 0; // Index of the next process to be loaded
 
+/* State of a CPU is kept here rather than on its thread's stack so that
+ * it can be saved and restored at a slot boundary */
 struct cpu_args {
     struct timer_id_t *timer_id;
     int id;
+    struct pcb_t *proc;
+    int time_left;
+    int stopped;
+    int parked;         // Waiting for a process to be added to a queue
+    uint64_t parked_at; // Slot in which the CPU was parked
+    int was_parked;
+    int restored_parked; // Parked when the checkpoint was taken
 };
 
-static void *cpu_routine(void *args) {
-    struct timer_id_t *timer_id = ((struct cpu_args *)args)->timer_id;
-    int id = ((struct cpu_args *)args)->id;
-    /* Check for new process in ready queue */
-    int time_left = 0;
-    struct pcb_t *proc = NULL;
-    while (1) {
-        /* Check the status of current process */
-        if (proc == NULL) {
-            /* No process is running, the we load new process from
-             * ready queue */
-            proc = get_proc();
-        } else if (proc->pc == proc->code->size) {
-            /* The porcess has finish it job */
-            printf("\tCPU %d: Processed %2d has finished\n", id, proc->pid);
-            free(proc);
-            proc = get_proc();
-            time_left = 0;
-        } else if (time_left == 0) {
-            /* The process has done its job in current time slot */
-            printf("\tCPU %d: Put process %2d to run queue\n", id, proc->pid);
-            put_proc(proc);
-            proc = get_proc();
-        }
-
-        /* Recheck process status after loading new process */
-        if (proc == NULL && done) {
-            /* No process to run, exit */
-            printf("\tCPU %d: stopped\n", id);
-            break;
-        } else if (proc == NULL) {
-            /* There may be new processes to run in
-             * next time slots, just skip current slot */
-            next_slot(timer_id);
-            continue;
-        } else if (time_left == 0) {
-            printf("\tCPU %d: Dispatched process %2d\n", id, proc->pid);
-            time_left = time_slot;
+static struct cpu_args *args;
+static int threaded = 0; // CPUs run on their own threads driven by the timer
+
+/* Cold cache model: a process dispatched on another CPU than the last one
+ * stalls for one slot per [cache_warmup] pages it has mapped. 0 disables */
+static uint32_t cache_warmup = 0;
+static int report_migrations = 0; // Print the migrations of finished processes
+static int report_vspace = 0;     // Print the virtual space of finished processes
+
+/* Idle CPUs park themselves in this FIFO instead of polling the queues
+ * every slot. Adding a process to a queue wakes exactly one of them, the
+ * one which has been idle for the longest time */
+static int *parked_cpus;
+static int parked_head = 0;
+static int num_parked = 0;
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void resume_cpu(struct cpu_args *cpu) {
+    cpu->was_parked = 1;
+    __atomic_store_n(&cpu->parked, 0, __ATOMIC_RELEASE);
+    if (threaded) {
+        unpark_event(cpu->timer_id);
+    }
+}
+
+static void wake_one_cpu(void) {
+    pthread_mutex_lock(&park_lock);
+    if (num_parked > 0) {
+        resume_cpu(&args[parked_cpus[parked_head]]);
+        parked_head = (parked_head + 1) % num_cpus;
+        num_parked--;
+    }
+    pthread_mutex_unlock(&park_lock);
+}
+
+static void wake_all_cpus(void) {
+    pthread_mutex_lock(&park_lock);
+    while (num_parked > 0) {
+        resume_cpu(&args[parked_cpus[parked_head]]);
+        parked_head = (parked_head + 1) % num_cpus;
+        num_parked--;
+    }
+    pthread_mutex_unlock(&park_lock);
+}
+
+/* Park [cpu] unless a process has arrived, or nothing can arrive anymore
+ * since it last looked at the queues. Return 1 if it has been parked: it
+ * must then sleep in park_slot even if it is woken up in the meantime, as
+ * the wake is only consumed there */
+static int park_cpu(struct cpu_args *cpu) {
+    int parked = 0;
+    pthread_mutex_lock(&park_lock);
+    if ((!done || waiting_procs() > 0) && queue_empty()) {
+        cpu->parked_at = current_time();
+        cpu->parked = 1;
+        parked_cpus[(parked_head + num_parked) % num_cpus] = cpu->id;
+        num_parked++;
+        parked = 1;
+    }
+    pthread_mutex_unlock(&park_lock);
+    return parked;
+}
+
+static uint64_t checkpoint_slot = 0;
+static const char *checkpoint_path = "checkpoint.bin";
+/* I/O accounting, in CPU slots for [busy_slots] and in time slots for the
+ * others. [slot_busy] counts the CPUs running in the current slot */
+static uint64_t busy_slots = 0;
+static uint64_t io_requests = 0;
+static uint64_t io_slots = 0;      // Slots with a process blocked on I/O
+static uint64_t overlap_slots = 0; // ... while a CPU was running
+static uint32_t slot_busy = 0;
+
+/* Working set sampling: every [sample_interval] slots the accessed and
+ * dirty bits of every process are harvested into [prefix]_ws.csv, the
+ * frame heat map is written to [prefix]_heat.csv at the end */
+static uint64_t sample_interval = 0;
+static const char *sample_prefix = "access";
+static FILE *ws_file = NULL;
+
+/* Frames moved by memory compaction every slot, 0 disables it */
+static uint32_t compact_budget = 0;
+static struct pcb_t **live_procs = NULL;
+static int num_live = 0;
+static int live_capacity = 0;
+
+static uint64_t dump_interval = 0;    // Print the frames written every this many slots
+static const char *image_path = NULL; // Binary image of the memory written at the end
+
+/* The tick hook is only installed once a feature needs it, I/O being
+ * noticed when the first process blocks */
+static int tick_hooked = 0;
+static void use_tick_hook(void);
+
+/* Run CPU [cpu] for one time slot. Return 0 once it has stopped, 2 if it
+ * has parked and 1 otherwise */
+static int cpu_step(struct cpu_args *cpu) {
+    int id = cpu->id;
+    int time_left = cpu->time_left;
+    struct pcb_t *proc = cpu->proc;
+
+    if (cpu->was_parked) {
+        /* Account every slot spent parked at once */
+        stats_cpu_slots(id, 0, current_time() - cpu->parked_at - 1);
+        cpu->was_parked = 0;
+    }
+
+    /* Check the status of current process */
+    if (proc == NULL) {
+        /* No process is running, the we load new process from
+         * ready queue */
+        proc = get_proc(id);
+    } else if (proc->pc == proc->code->size) {
+        /* The porcess has finish it job */
+        printf("\tCPU %d: Processed %2d has finished\n", id, proc->pid);
+        if (finish_proc(proc, current_time())) {
+            printf("\tCPU %d: Process %2d missed its deadline by %lu slots\n",
+                   id, proc->pid, (unsigned long)(current_time() - proc->deadline));
+        }
+        if (report_migrations) {
+            printf("\tCPU %d: Process %2d migrated %u times, %u cold slots\n",
+                   id, proc->pid, proc->migrations, proc->cold_slots);
         }
+        if (report_vspace) {
+            printf("\tCPU %d: Process %2d virtual space: %u free pages in %u extents, largest %u, fragmentation %u%%\n",
+                   id, proc->pid, proc->vspace->free_pages, proc->vspace->extents,
+                   vspace_largest(proc->vspace), vspace_fragmentation(proc->vspace));
+        }
+        vspace_destroy(proc->vspace);
+        free(proc);
+        proc = get_proc(id);
+        time_left = 0;
+    } else if (time_left == 0) {
+        /* The process has done its job in current time slot */
+        printf("\tCPU %d: Put process %2d to run queue\n", id, proc->pid);
+        put_proc(proc);
+        proc = get_proc(id);
+    }
+
+    /* Recheck process status after loading new process. Processes
+     * blocked on I/O will come back, so keep waiting for them */
+    cpu->proc = proc;
+    if (proc == NULL && done && waiting_procs() == 0) {
+        /* No process to run, exit */
+        printf("\tCPU %d: stopped\n", id);
+        cpu->stopped = 1;
+        return 0;
+    } else if (proc == NULL) {
+        /* There may be new processes to run in
+         * next time slots, sleep until one arrives */
+        stats_cpu_slots(id, 0, 1);
+        cpu->time_left = time_left;
+        return park_cpu(cpu) ? 2 : 1;
+    } else if (time_left == 0) {
+        printf("\tCPU %d: Dispatched process %2d\n", id, proc->pid);
+        time_left = time_slot;
+        if (proc->last_cpu != -1 && proc->last_cpu != id) {
+            /* Its working set has to be brought into this CPU's cache */
+            proc->migrations++;
+            if (cache_warmup > 0) {
+                proc->stall = (mem_pages(proc) + cache_warmup - 1) / cache_warmup;
+            }
+        }
+        proc->last_cpu = id;
+    }
 
-        /* Run current process */
+    /* Run current process, unless it is still waiting for its cache */
+    if (proc->stall > 0) {
+        proc->stall--;
+        proc->cold_slots++;
+    } else {
         run(proc);
-        time_left--;
-        next_slot(timer_id);
     }
-    detach_event(timer_id);
+    stats_cpu_slots(id, 1, 1);
+    __atomic_fetch_add(&busy_slots, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&slot_busy, 1, __ATOMIC_RELAXED);
+    cpu->time_left = time_left - 1;
+    if (proc->io_ticks > 0) {
+        /* The CPU is free again until the I/O is over */
+        uint64_t wake = current_time() + proc->io_ticks;
+        printf("\tCPU %d: Process %2d waits for I/O until slot %lu\n", id, proc->pid, (unsigned long)wake);
+        proc->io_ticks = 0;
+        __atomic_fetch_add(&io_requests, 1, __ATOMIC_RELAXED);
+        use_tick_hook();
+        wait_proc(proc, wake);
+        cpu->proc = NULL;
+        cpu->time_left = 0;
+    }
+    return 1;
+}
+
+static void *cpu_routine(void *arg) {
+    struct cpu_args *cpu = (struct cpu_args *)arg;
+    /* A CPU restored from a checkpoint may have stopped or parked already */
+    int state = cpu->restored_parked ? 2 : 1;
+    while (!cpu->stopped && state != 0) {
+        if (state == 2) {
+            park_slot(cpu->timer_id);
+        }
+        state = cpu_step(cpu);
+        if (state == 1) {
+            next_slot(cpu->timer_id);
+        }
+    }
+    detach_event(cpu->timer_id);
     pthread_exit(NULL);
 }
 
-static void *ld_routine(void *args) {
-    struct timer_id_t *timer_id = (struct timer_id_t *)args;
-    int i = 0;
-    while (i < num_processes) {
-        struct pcb_t *proc = load(ld_processes.path[i]);
-        while (current_time() < ld_processes.start_time[i]) {
-            next_slot(timer_id);
+/* Read the next arrival record from the configure file, if any is left */
+static void ld_fetch(void) {
+    ld_processes.pending = 0;
+    if (ld_next == num_processes) {
+        return;
+    }
+    char proc[LD_PATH_MAX];
+    char line[LD_PATH_MAX];
+    /* [start time] [process] [optional relative deadline] */
+    ld_processes.deadline = 0;
+    do {
+        ld_processes.offset = ftell(ld_processes.file);
+        if (fgets(line, sizeof(line), ld_processes.file) == NULL) {
+            /* The trace may be shorter than announced in its header */
+            num_processes = ld_next;
+            return;
+        }
+        ld_processes.line++;
+    } while (line[strspn(line, " \t\r\n")] == '\0'); // skip blank lines
+    if (sscanf(line, "%lu %511s %u", &ld_processes.start_time, proc, &ld_processes.deadline) < 2) {
+        printf("Invalid process description at line %d of %s\n", ld_processes.line, ld_processes.config);
+        exit(1);
+    }
+    size_t dir_len = strlen(ld_processes.dir);
+    const char *sep = dir_len > 0 && ld_processes.dir[dir_len - 1] != '/' ? "/" : "";
+    int len = snprintf(ld_processes.path, sizeof(ld_processes.path), "%s%s%s", ld_processes.dir, sep, proc);
+    if (len < 0 || (size_t)len >= sizeof(ld_processes.path)) {
+        printf("Path of process %s is too long\n", proc);
+        exit(1);
+    }
+    ld_processes.pending = 1;
+}
+
+/* Open the configure file at [path] and position it at the [index]th
+ * arrival record, found at [offset] after [line] lines */
+static void ld_open(const char *path, int index, long offset, int line) {
+    if ((ld_processes.file = fopen(path, "r")) == NULL) {
+        printf("Cannot find configure file at %s\n", path);
+        exit(1);
+    }
+    /* Records are short, read them in large chunks */
+    setvbuf(ld_processes.file, NULL, _IOFBF, 1 << 16);
+    ld_processes.config = path;
+    ld_processes.line = line;
+    ld_next = index;
+    if (offset != 0 && fseek(ld_processes.file, offset, SEEK_SET) != 0) {
+        printf("Cannot seek to arrival %d in %s\n", index, path);
+        exit(1);
+    }
+}
+
+/* Do the loader's work for one time slot. Return 0 once every process
+ * has been loaded */
+static int ld_step(void) {
+    if (!ld_processes.pending) {
+        if (ld_processes.file != NULL) {
+            fclose(ld_processes.file);
+            ld_processes.file = NULL;
+        }
+        pthread_mutex_lock(&park_lock);
+        done = 1;
+        pthread_mutex_unlock(&park_lock);
+        /* Parked CPUs have to notice that nothing else will arrive */
+        wake_all_cpus();
+        return 0;
+    }
+    /* Load only when the process arrives so that no half-loaded process
+     * is pending when a checkpoint is taken */
+    if (current_time() >= ld_processes.start_time) {
+        struct pcb_t *proc = load(ld_processes.path);
+        printf("\tLoaded a process at %s, PID: %d\n", ld_processes.path, proc->pid);
+        if (ld_processes.deadline != 0 &&
+            !admit_proc(proc, ld_processes.deadline, current_time())) {
+            printf("\tRejected deadline of process %2d, not enough capacity\n", proc->pid);
         }
-        printf("\tLoaded a process at %s, PID: %d\n", ld_processes.path[i], proc->pid);
         add_proc(proc);
-        free(ld_processes.path[i]);
-        i++;
+        ld_next++;
+        ld_fetch();
+    }
+    return 1;
+}
+
+static void *ld_routine(void *args) {
+    struct timer_id_t *timer_id = (struct timer_id_t *)args;
+    while (ld_step()) {
         next_slot(timer_id);
     }
-    free(ld_processes.path);
-    free(ld_processes.start_time);
-    done = 1;
     detach_event(timer_id);
     pthread_exit(NULL);
 }
 
-static void read_config(const char *path) {
-    FILE *file;
-    if ((file = fopen(path, "r")) == NULL) {
-        printf("Cannot find configure file at %s\n", path);
-        exit(1);
-    }
-    fscanf(file, "%d %d %d\n", &time_slot, &num_cpus, &num_processes);
-    ld_processes.path = (char **)malloc(sizeof(char *) * num_processes);
-    ld_processes.start_time = (unsigned long *)malloc(sizeof(unsigned long) * num_processes);
-    int i;
-    for (i = 0; i < num_processes; i++) {
-        ld_processes.path[i] = (char *)malloc(sizeof(char) * 100);
-        ld_processes.path[i][0] = '\0';
-        strcat(ld_processes.path[i], "input/proc/");
-        char proc[100];
-        fscanf(file, "%lu %s\n", &ld_processes.start_time[i], proc);
-        strcat(ld_processes.path[i], proc);
+/* Simulated CPUs are multiplexed over a pool of worker threads. Each
+ * worker owns a contiguous range of CPUs and advances all of them by one
+ * slot between two barriers. The last thread to reach the first barrier
+ * advances the clock and runs the loader while every other worker waits,
+ * which also makes it a quiescent point for the tick hook. */
+struct worker_t {
+    pthread_t thread;
+    int first_cpu;
+    int last_cpu; // exclusive
+    int running;  // CPUs which have not stopped in the current slot
+};
+
+static struct worker_t *workers;
+static int num_workers;
+static pthread_barrier_t slot_barrier;
+static int loading = 1;
+static int finished = 0;
+
+static void *worker_routine(void *arg) {
+    struct worker_t *worker = (struct worker_t *)arg;
+    while (1) {
+        worker->running = 0;
+        for (int i = worker->first_cpu; i < worker->last_cpu; i++) {
+            if (__atomic_load_n(&args[i].parked, __ATOMIC_ACQUIRE)) {
+                worker->running++;
+            } else if (!args[i].stopped && cpu_step(&args[i])) {
+                worker->running++;
+            }
+        }
+
+        if (pthread_barrier_wait(&slot_barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+            int running = 0;
+            for (int i = 0; i < num_workers; i++) {
+                running += workers[i].running;
+            }
+            finished = !loading && running == 0;
+            if (!finished) {
+                advance_time();
+                printf("Time slot %3lu\n", (unsigned long)current_time());
+                if (loading) {
+                    loading = ld_step();
+                }
+            }
+        }
+        pthread_barrier_wait(&slot_barrier);
+        if (finished) {
+            break;
+        }
     }
+    return NULL;
 }
 
-int main(int argc, char *argv[]) {
-    /* Read config */
-    if (argc != 2) {
-        printf("Usage: os [path to configure file]\n");
-        return 1;
+/* Run the simulation on [count] workers. With a single worker everything
+ * happens on the calling thread in a fixed order (the loader first, then
+ * the CPUs by ID), so the output is deterministic */
+static void run_workers(int count) {
+    if (count > num_cpus) {
+        count = num_cpus;
     }
-    read_config(argv[1]);
+    num_workers = count;
+    workers = (struct worker_t *)calloc(count, sizeof(struct worker_t));
+    for (int i = 0; i < count; i++) {
+        workers[i].first_cpu = i * num_cpus / count;
+        workers[i].last_cpu = (i + 1) * num_cpus / count;
+    }
+    pthread_barrier_init(&slot_barrier, NULL, count);
+
+    printf("Time slot %3lu\n", (unsigned long)current_time());
+    loading = ld_step();
+    for (int i = 1; i < count; i++) {
+        pthread_create(&workers[i].thread, NULL, worker_routine, &workers[i]);
+    }
+    worker_routine(&workers[0]);
+    for (int i = 1; i < count; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    pthread_barrier_destroy(&slot_barrier);
+    free(workers);
+}
 
+/* Run every CPU and the loader on its own thread, in lockstep with the
+ * timer thread */
+static void run_threads(void) {
+    threaded = 1;
     pthread_t *cpu = (pthread_t *)malloc(num_cpus * sizeof(pthread_t));
-    struct cpu_args *args = (struct cpu_args *)malloc(sizeof(struct cpu_args) * num_cpus);
     pthread_t ld;
 
     /* Init timer */
     int i;
     for (i = 0; i < num_cpus; i++) {
         args[i].timer_id = attach_event();
-        args[i].id = i;
     }
     struct timer_id_t *ld_event = attach_event();
 
-    /* Init memory */
-    init_mem();
-
     start_timer();
 
-    /* Init scheduler */
-    init_scheduler();
-
     /* Run CPU and loader */
     pthread_create(&ld, NULL, ld_routine, (void *)ld_event);
     for (i = 0; i < num_cpus; i++) {
@@ -156,9 +458,362 @@ int main(int argc, char *argv[]) {
 
     /* Stop timer */
     stop_timer();
+    free(cpu);
+}
+
+static void read_config(const char *path) {
+    ld_open(path, 0, 0, 1);
+    char header[LD_PATH_MAX];
+    if (fgets(header, sizeof(header), ld_processes.file) == NULL ||
+        sscanf(header, "%d %d %d", &time_slot, &num_cpus, &num_processes) != 3) {
+        printf("Invalid header in %s\n", path);
+        exit(1);
+    }
+    ld_fetch();
+}
+
+static void save_checkpoint(const char *path) {
+    FILE *file;
+    if ((file = fopen(path, "wb")) == NULL) {
+        printf("Cannot create checkpoint at %s\n", path);
+        exit(1);
+    }
+    ckpt_write_u32(file, CHECKPOINT_MAGIC);
+    ckpt_write_u32(file, CHECKPOINT_VERSION);
+    ckpt_write_u64(file, current_time());
+    ckpt_write_u32(file, time_slot);
+    ckpt_write_u32(file, num_cpus);
+
+    /* Where to resume reading arrivals, the configure file itself is
+     * not copied and must not change before the restore */
+    uint32_t len = ld_processes.pending ? strlen(ld_processes.config) : 0;
+    ckpt_write_u32(file, num_processes);
+    ckpt_write_u32(file, ld_next);
+    ckpt_write_u64(file, ld_processes.pending ? ld_processes.offset : 0);
+    ckpt_write_u32(file, ld_processes.pending ? ld_processes.line - 1 : 0);
+    ckpt_write_u32(file, len);
+    ckpt_write(file, ld_processes.config, len);
+    len = strlen(ld_processes.dir);
+    ckpt_write_u32(file, len);
+    ckpt_write(file, ld_processes.dir, len);
+
+    save_loader(file);
+    save_mem(file);
+    save_scheduler(file);
+    ckpt_write_u64(file, busy_slots);
+    ckpt_write_u64(file, io_requests);
+    ckpt_write_u64(file, io_slots);
+    ckpt_write_u64(file, overlap_slots);
+    for (int i = 0; i < num_cpus; i++) {
+        ckpt_write_u32(file, args[i].stopped);
+        ckpt_write_u32(file, args[i].time_left);
+        ckpt_write_u32(file, args[i].parked);
+        ckpt_write_u64(file, args[i].parked_at);
+        ckpt_write_u32(file, args[i].was_parked);
+        ckpt_write_u32(file, args[i].proc != NULL);
+        if (args[i].proc != NULL) {
+            save_proc(file, args[i].proc);
+        }
+    }
+    /* Parked CPUs in the order they will be woken up */
+    ckpt_write_u32(file, num_parked);
+    for (int i = 0; i < num_parked; i++) {
+        ckpt_write_u32(file, parked_cpus[(parked_head + i) % num_cpus]);
+    }
+    fclose(file);
+}
+
+/* Must be called after init_mem and init_scheduler */
+static void restore_cpus(FILE *file) {
+    busy_slots = ckpt_read_u64(file);
+    io_requests = ckpt_read_u64(file);
+    io_slots = ckpt_read_u64(file);
+    overlap_slots = ckpt_read_u64(file);
+    for (int i = 0; i < num_cpus; i++) {
+        args[i].stopped = ckpt_read_u32(file);
+        args[i].time_left = ckpt_read_u32(file);
+        args[i].parked = ckpt_read_u32(file);
+        args[i].parked_at = ckpt_read_u64(file);
+        args[i].was_parked = ckpt_read_u32(file);
+        args[i].restored_parked = args[i].parked;
+        args[i].proc = ckpt_read_u32(file) ? restore_proc(file) : NULL;
+    }
+    parked_head = 0;
+    num_parked = ckpt_read_u32(file);
+    if (num_parked > num_cpus) {
+        printf("Checkpoint is corrupted\n");
+        exit(1);
+    }
+    for (int i = 0; i < num_parked; i++) {
+        parked_cpus[i] = ckpt_read_u32(file);
+        if (parked_cpus[i] < 0 || parked_cpus[i] >= num_cpus) {
+            printf("Checkpoint is corrupted\n");
+            exit(1);
+        }
+    }
+}
+
+/* Read everything before the per-CPU state, leaving [file] positioned at
+ * the memory image */
+static FILE *open_checkpoint(const char *path) {
+    FILE *file;
+    if ((file = fopen(path, "rb")) == NULL) {
+        printf("Cannot find checkpoint at %s\n", path);
+        exit(1);
+    }
+    if (ckpt_read_u32(file) != CHECKPOINT_MAGIC || ckpt_read_u32(file) != CHECKPOINT_VERSION) {
+        printf("%s is not a checkpoint of this simulator\n", path);
+        exit(1);
+    }
+    set_time(ckpt_read_u64(file));
+    time_slot = ckpt_read_u32(file);
+    num_cpus = ckpt_read_u32(file);
+
+    num_processes = ckpt_read_u32(file);
+    int next = ckpt_read_u32(file);
+    long offset = ckpt_read_u64(file);
+    int line = ckpt_read_u32(file);
+    uint32_t len = ckpt_read_u32(file);
+    char *config = (char *)malloc(len + 1);
+    ckpt_read(file, config, len);
+    config[len] = '\0';
+    len = ckpt_read_u32(file);
+    char *dir = (char *)malloc(len + 1);
+    ckpt_read(file, dir, len);
+    dir[len] = '\0';
+    ld_processes.dir = dir;
+    if (config[0] != '\0') {
+        ld_open(config, next, offset, line);
+        ld_fetch();
+    } else {
+        ld_next = num_processes;
+    }
+
+    restore_loader(file);
+    return file;
+}
+
+static FILE *open_sample_file(const char *suffix) {
+    char path[LD_PATH_MAX];
+    int len = snprintf(path, sizeof(path), "%s_%s.csv", sample_prefix, suffix);
+    FILE *file;
+    if (len < 0 || (size_t)len >= sizeof(path) || (file = fopen(path, "w")) == NULL) {
+        printf("Cannot create %s_%s.csv\n", sample_prefix, suffix);
+        exit(1);
+    }
+    return file;
+}
+
+static void sample_proc(struct pcb_t *proc, void *arg) {
+    uint32_t accessed, dirty;
+    harvest_pages(proc, &accessed, &dirty);
+    fprintf(ws_file, "%lu,%u,%u,%u,%u\n", (unsigned long)*(uint64_t *)arg,
+            proc->pid, mem_pages(proc), accessed, dirty);
+}
+
+/* Harvest the access bits of every process, running or not */
+static void sample_working_sets(uint64_t time) {
+    for (int i = 0; i < num_cpus; i++) {
+        if (args[i].proc != NULL) {
+            sample_proc(args[i].proc, &time);
+        }
+    }
+    for_each_proc(sample_proc, &time);
+}
+
+static void collect_proc(struct pcb_t *proc, void *arg) {
+    (void)arg;
+    if (num_live == live_capacity) {
+        live_capacity = live_capacity ? live_capacity * 2 : 16;
+        live_procs = (struct pcb_t **)realloc(live_procs, sizeof(struct pcb_t *) * live_capacity);
+    }
+    live_procs[num_live++] = proc;
+}
+
+/* Compact the memory with the page tables of every live process */
+static void compact_step(void) {
+    num_live = 0;
+    for (int i = 0; i < num_cpus; i++) {
+        if (args[i].proc != NULL) {
+            collect_proc(args[i].proc, NULL);
+        }
+    }
+    for_each_proc(collect_proc, NULL);
+    compact_mem(compact_budget, live_procs, num_live);
+}
+
+/* Print the I/O accounting, if any process did I/O */
+static void report_io(void) {
+    if (io_requests == 0) {
+        return;
+    }
+    uint64_t cpu_slots = (uint64_t)num_cpus * current_time();
+    printf("\nI/O: %lu requests, %lu slots with I/O pending, %lu of them overlapped with computation\n",
+           (unsigned long)io_requests, (unsigned long)io_slots, (unsigned long)overlap_slots);
+    printf("CPU utilization: %lu of %lu slots (%lu%%)\n",
+           (unsigned long)busy_slots, (unsigned long)cpu_slots,
+           (unsigned long)(cpu_slots ? busy_slots * 100 / cpu_slots : 0));
+}
+
+static void on_tick(uint64_t time) {
+    /* Account the slot which just ended */
+    if (waiting_procs() > 0) {
+        io_slots++;
+        overlap_slots += slot_busy > 0;
+    }
+    slot_busy = 0;
+    if (wake_procs(time) > 0 && done && waiting_procs() == 0) {
+        /* CPUs parked for these processes may have to stop now */
+        wake_all_cpus();
+    }
+    if (compact_budget != 0) {
+        compact_step();
+    }
+    if (sample_interval != 0 && time % sample_interval == 0) {
+        sample_working_sets(time);
+    }
+    if (time == checkpoint_slot) {
+        save_checkpoint(checkpoint_path);
+    }
+    if (dump_interval != 0 && time % dump_interval == 0) {
+        printf("\nMEMORY CHANGES AT SLOT %lu: \n", (unsigned long)time);
+        dump_dirty();
+    }
+}
+
+static void use_tick_hook(void) {
+    if (!__atomic_exchange_n(&tick_hooked, 1, __ATOMIC_ACQ_REL)) {
+        set_tick_hook(on_tick);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *restore_path = NULL;
+    int pool_size = -1; // -1: one thread per CPU driven by the timer
+    int opt;
+    while ((opt = getopt(argc, argv, "dvw:a:c:p:i:b:t:x:m:s:o:r:")) != -1) {
+        switch (opt) {
+        case 'a':
+            set_affinity_window(atoi(optarg));
+            report_migrations = 1;
+            break;
+        case 'c':
+            cache_warmup = atoi(optarg);
+            report_migrations = 1;
+            break;
+        case 'd':
+            pool_size = 1;
+            break;
+        case 'v':
+            report_vspace = 1;
+            break;
+        case 'p':
+            ld_processes.dir = optarg;
+            break;
+        case 'i':
+            dump_interval = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            image_path = optarg;
+            break;
+        case 't':
+            sample_interval = strtoull(optarg, NULL, 10);
+            break;
+        case 'x':
+            sample_prefix = optarg;
+            break;
+        case 'm':
+            compact_budget = atoi(optarg);
+            break;
+        case 'w':
+            pool_size = atoi(optarg);
+            if (pool_size <= 0) {
+                pool_size = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            break;
+        case 's':
+            checkpoint_slot = strtoull(optarg, NULL, 10);
+            break;
+        case 'o':
+            checkpoint_path = optarg;
+            break;
+        case 'r':
+            restore_path = optarg;
+            break;
+        default:
+            optind = argc + 1;
+        }
+    }
+
+    /* Read config */
+    FILE *checkpoint = NULL;
+    if (restore_path != NULL && optind == argc) {
+        checkpoint = open_checkpoint(restore_path);
+    } else if (restore_path == NULL && optind == argc - 1) {
+        read_config(argv[optind]);
+    } else {
+        printf("Usage: os [-d | -w workers] [-a affinity priority window] [-c cache warmup pages] [-v] [-p program directory] [-i dump interval] [-b memory image] [-t sample interval] [-x sample prefix] [-m compaction budget] [-s slot] [-o snapshot] [path to configure file | -r snapshot]\n");
+        return 1;
+    }
+    init_stats(num_cpus);
+
+    args = (struct cpu_args *)calloc(num_cpus, sizeof(struct cpu_args));
+    for (int i = 0; i < num_cpus; i++) {
+        args[i].id = i;
+    }
+    parked_cpus = (int *)malloc(sizeof(int) * num_cpus);
+    set_rt_capacity(num_cpus);
+    set_wake_handler(wake_one_cpu);
+
+    /* Init memory */
+    init_mem();
+
+    /* Init scheduler */
+    init_scheduler();
+
+    if (checkpoint != NULL) {
+        restore_mem(checkpoint);
+        restore_scheduler(checkpoint);
+        restore_cpus(checkpoint);
+        fclose(checkpoint);
+    }
+    if (compact_budget != 0 || sample_interval != 0 || checkpoint_slot != 0 ||
+        dump_interval != 0 || waiting_procs() > 0 || io_requests > 0) {
+        use_tick_hook();
+    }
+    if (sample_interval != 0) {
+        ws_file = open_sample_file("ws");
+        fprintf(ws_file, "slot,pid,mapped,accessed,dirty\n");
+    }
+
+    if (pool_size > 0) {
+        run_workers(pool_size);
+    } else {
+        run_threads();
+    }
+
+    report_rt();
+    report_io();
+    report_pages();
 
     printf("\nMEMORY CONTENT: \n");
     dump();
+    if (ws_file != NULL) {
+        fclose(ws_file);
+        FILE *heat = open_sample_file("heat");
+        dump_heat(heat);
+        fclose(heat);
+    }
+    if (image_path != NULL) {
+        FILE *image;
+        if ((image = fopen(image_path, "wb")) == NULL) {
+            printf("Cannot create memory image at %s\n", image_path);
+            return 1;
+        }
+        dump_image(image);
+        fclose(image);
+    }
 
+    stats_dump();
     return 0;
 }
@@ -11,8 +11,7 @@ int main(int argc, char ** argv) {
 		exit(1);
 	}
 	struct pcb_t * proc = load(argv[1]);
-	unsigned int i;
-	for (i = 0; i < proc->code->size; i++) {
+	while (proc->pc < proc->code->size) {
 		run(proc);
 	}
 	dump();
@@ -7,35 +7,75 @@ int empty(struct queue_t *q) { return (q->size == 0); }
 
 void enqueue(struct queue_t *q, struct pcb_t *proc) {
     /* TODO: put a new process to queue [q] */
-    if (q->size == MAX_QUEUE_SIZE) {
-        return; // no space left
+    if (q->size == q->capacity) {
+        q->capacity = q->capacity ? q->capacity * 2 : 16;
+        q->proc = realloc(q->proc, sizeof(struct pcb_t *) * q->capacity);
     }
     q->proc[q->size] = proc;
 
     ++q->size;
 }
 
+static struct pcb_t *remove_at(struct queue_t *q, int index) {
+    struct pcb_t *proc = q->proc[index];
+    for (int i = index; i < q->size - 1; i++) {
+        q->proc[i] = q->proc[i + 1];
+    }
+    q->proc[q->size - 1] = NULL;
+    --q->size;
+    return proc;
+}
+
+/* Index of the process with the highest priority among those which ran on
+ * [cpu] last, or among all of them if [cpu] is negative. -1 if none */
+static int best_index(struct queue_t *q, int cpu) {
+    int best = -1;
+    for (int index = 0; index < q->size; index++) {
+        struct pcb_t *proc = q->proc[index];
+        if ((cpu < 0 || proc->last_cpu == cpu) && (best == -1 || q->proc[best]->priority < proc->priority)) {
+            best = index;
+        }
+    }
+    return best;
+}
+
 struct pcb_t *dequeue(struct queue_t *q) {
     /* TODO: return a pcb whose prioprity is the highest
      * in the queue [q] and remember to remove it from q
      * */
-    struct pcb_t *highestPriorityPCB = NULL;
-    int highestPriorityPCBIndex = -1;
+    int index = best_index(q, -1);
+    return index == -1 ? NULL : remove_at(q, index);
+}
 
-    for (int index = 0; index < q->size; index++) {
-        if (highestPriorityPCB == NULL || highestPriorityPCB->priority < q->proc[index]->priority) {
-            highestPriorityPCB = q->proc[index];
-            highestPriorityPCBIndex = index;
-        }
+struct pcb_t *dequeue_affine(struct queue_t *q, int cpu, uint32_t window) {
+    int best = best_index(q, -1);
+    if (best == -1) {
+        return NULL;
     }
+    int affine = best_index(q, cpu);
+    if (affine != -1 && q->proc[affine]->priority + window >= q->proc[best]->priority) {
+        return remove_at(q, affine);
+    }
+    return remove_at(q, best);
+}
 
-    if (highestPriorityPCB != NULL) {
-        for (int index = highestPriorityPCBIndex; index < q->size - 1; index++) {
-            q->proc[index] = q->proc[index + 1];
+static int earliest_index(struct queue_t *q) {
+    int earliest = -1;
+    for (int index = 0; index < q->size; index++) {
+        uint64_t deadline = q->proc[index]->deadline;
+        if (deadline != 0 && (earliest == -1 || deadline < q->proc[earliest]->deadline)) {
+            earliest = index;
         }
-        q->proc[q->size - 1] = NULL;
-        --q->size;
     }
+    return earliest;
+}
+
+uint64_t earliest_deadline(struct queue_t *q) {
+    int index = earliest_index(q);
+    return index == -1 ? 0 : q->proc[index]->deadline;
+}
 
-    return highestPriorityPCB;
+struct pcb_t *dequeue_earliest(struct queue_t *q) {
+    int index = earliest_index(q);
+    return index == -1 ? NULL : remove_at(q, index);
 }
@@ -1,15 +1,107 @@
 #include "sched.h"
+#include "checkpoint.h"
 #include "common.h"
 #include "queue.h"
+#include "stats.h"
 #include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #include "string.h"
 
 static struct queue_t ready_queue;
 static struct queue_t run_queue;
 static pthread_mutex_t queue_lock;
+static void (*wake_handler)(void) = NULL;
+static int affinity_window = -1;
 
-int queue_empty(void) { return (empty(&ready_queue) && empty(&run_queue)); }
+/* Utilizations are kept in millionths of a CPU */
+#define UTIL_SCALE 1000000ULL
+static uint64_t rt_capacity = UTIL_SCALE;
+static uint64_t rt_util = 0;
+static uint32_t rt_admitted = 0;
+static uint32_t rt_rejected = 0;
+static uint32_t rt_missed = 0;
+static pthread_mutex_t rt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Processes blocked on I/O, in a binary min-heap ordered by wake-up slot
+ * and then by the order they started waiting. Protected by queue_lock */
+struct wait_entry_t {
+    uint64_t wake;
+    uint64_t seq;
+    struct pcb_t *proc;
+};
+static struct wait_entry_t *wait_heap = NULL;
+static int wait_size = 0;
+static int wait_capacity = 0;
+static uint64_t wait_seq = 0;
+
+int queue_empty(void) {
+    stats_lock(&queue_lock, STAT_LOCK_QUEUE);
+    int ret = empty(&ready_queue) && empty(&run_queue);
+    stats_unlock(&queue_lock, STAT_LOCK_QUEUE);
+    return ret;
+}
+
+void set_affinity_window(int window) {
+    affinity_window = window;
+}
+
+void set_rt_capacity(uint32_t capacity) {
+    rt_capacity = capacity * UTIL_SCALE;
+}
+
+/* Share of a CPU needed to run all instructions of [proc] before its
+ * relative deadline */
+static uint64_t utilization(struct pcb_t *proc) {
+    return proc->code->size * UTIL_SCALE / proc->rel_deadline;
+}
+
+int admit_proc(struct pcb_t *proc, uint32_t relative, uint64_t now) {
+    if (relative == 0) {
+        return 0;
+    }
+    proc->rel_deadline = relative;
+    pthread_mutex_lock(&rt_lock);
+    uint64_t util = utilization(proc);
+    /* A process never runs on two CPUs at once, so it cannot use more
+     * than one of them whatever the total capacity is */
+    int admitted = util <= UTIL_SCALE && rt_util + util <= rt_capacity;
+    if (admitted) {
+        rt_util += util;
+        rt_admitted++;
+        proc->deadline = now + relative;
+    } else {
+        rt_rejected++;
+        proc->rel_deadline = 0;
+    }
+    pthread_mutex_unlock(&rt_lock);
+    return admitted;
+}
+
+int finish_proc(struct pcb_t *proc, uint64_t now) {
+    if (proc->deadline == 0) {
+        return 0;
+    }
+    int missed = now > proc->deadline;
+    pthread_mutex_lock(&rt_lock);
+    rt_util -= utilization(proc);
+    rt_missed += missed;
+    pthread_mutex_unlock(&rt_lock);
+    return missed;
+}
+
+void report_rt(void) {
+    if (rt_admitted + rt_rejected == 0) {
+        return;
+    }
+    printf("\nREAL-TIME: admitted %u, rejected %u, missed deadlines %u\n",
+           rt_admitted, rt_rejected, rt_missed);
+}
+
+void set_wake_handler(void (*handler)(void)) {
+    wake_handler = handler;
+}
 
 void init_scheduler(void) {
     ready_queue.size = 0;
@@ -17,32 +109,192 @@ void init_scheduler(void) {
     pthread_mutex_init(&queue_lock, NULL);
 }
 
-struct pcb_t *get_proc(void) {
+struct pcb_t *get_proc(int cpu) {
     /*TODO: get a process from [ready_queue]. If ready queue
      * is empty, push all processes in [run_queue] back to
      * [ready_queue] and return the highest priority one.
      * Remember to use lock to protect the queue.
      * */
-    // pthread_mutex_lock(&queue_lock);
+    stats_lock(&queue_lock, STAT_LOCK_QUEUE);
+    /* The real-time class takes precedence over the priority class and
+     * does not wait for the run queue to be recycled */
+    uint64_t ready_deadline = earliest_deadline(&ready_queue);
+    uint64_t run_deadline = earliest_deadline(&run_queue);
+    if (ready_deadline != 0 || run_deadline != 0) {
+        struct pcb_t *proc;
+        if (run_deadline == 0 || (ready_deadline != 0 && ready_deadline <= run_deadline)) {
+            proc = dequeue_earliest(&ready_queue);
+        } else {
+            proc = dequeue_earliest(&run_queue);
+        }
+        stats_unlock(&queue_lock, STAT_LOCK_QUEUE);
+        return proc;
+    }
     if (empty(&ready_queue) && !empty(&run_queue)) {
-        memcpy(ready_queue.proc, run_queue.proc, run_queue.size * sizeof(struct pcb_t *));
-        memset(run_queue.proc, 0, MAX_QUEUE_SIZE * sizeof(struct pcb_t *));
-        ready_queue.size = run_queue.size;
-        run_queue.size = 0;
+        struct queue_t temp = ready_queue;
+        ready_queue = run_queue;
+        run_queue = temp;
     }
-    struct pcb_t *proc = dequeue(&ready_queue);
-    // pthread_mutex_unlock(&queue_lock);
+    struct pcb_t *proc = affinity_window < 0 ? dequeue(&ready_queue) : dequeue_affine(&ready_queue, cpu, affinity_window);
+    stats_unlock(&queue_lock, STAT_LOCK_QUEUE);
     return proc;
 }
 
 void put_proc(struct pcb_t *proc) {
-    // pthread_mutex_lock(&queue_lock);
+    stats_lock(&queue_lock, STAT_LOCK_QUEUE);
     enqueue(&run_queue, proc);
-    // pthread_mutex_unlock(&queue_lock);
+    stats_unlock(&queue_lock, STAT_LOCK_QUEUE);
+    if (wake_handler != NULL) {
+        wake_handler();
+    }
 }
 
 void add_proc(struct pcb_t *proc) {
-    // pthread_mutex_lock(&queue_lock);
+    stats_lock(&queue_lock, STAT_LOCK_QUEUE);
     enqueue(&ready_queue, proc);
-    // pthread_mutex_unlock(&queue_lock);
+    stats_unlock(&queue_lock, STAT_LOCK_QUEUE);
+    if (wake_handler != NULL) {
+        wake_handler();
+    }
+}
+
+static int wait_before(const struct wait_entry_t *a, const struct wait_entry_t *b) {
+    return a->wake < b->wake || (a->wake == b->wake && a->seq < b->seq);
+}
+
+static void wait_swap(int i, int j) {
+    struct wait_entry_t temp = wait_heap[i];
+    wait_heap[i] = wait_heap[j];
+    wait_heap[j] = temp;
+}
+
+static void wait_push(struct wait_entry_t entry) {
+    if (wait_size == wait_capacity) {
+        wait_capacity = wait_capacity ? wait_capacity * 2 : 16;
+        wait_heap = realloc(wait_heap, sizeof(struct wait_entry_t) * wait_capacity);
+    }
+    int i = wait_size++;
+    wait_heap[i] = entry;
+    while (i > 0 && wait_before(&wait_heap[i], &wait_heap[(i - 1) / 2])) {
+        wait_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static struct pcb_t *wait_pop(void) {
+    struct pcb_t *proc = wait_heap[0].proc;
+    wait_heap[0] = wait_heap[--wait_size];
+    int i = 0;
+    while (1) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < wait_size && wait_before(&wait_heap[left], &wait_heap[smallest])) {
+            smallest = left;
+        }
+        if (right < wait_size && wait_before(&wait_heap[right], &wait_heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            break;
+        }
+        wait_swap(i, smallest);
+        i = smallest;
+    }
+    return proc;
+}
+
+void wait_proc(struct pcb_t *proc, uint64_t wake) {
+    stats_lock(&queue_lock, STAT_LOCK_QUEUE);
+    struct wait_entry_t entry = {wake, wait_seq++, proc};
+    wait_push(entry);
+    stats_unlock(&queue_lock, STAT_LOCK_QUEUE);
+}
+
+int wake_procs(uint64_t now) {
+    int woken = 0;
+    while (1) {
+        stats_lock(&queue_lock, STAT_LOCK_QUEUE);
+        struct pcb_t *proc = NULL;
+        if (wait_size > 0 && wait_heap[0].wake <= now) {
+            proc = wait_pop();
+        }
+        stats_unlock(&queue_lock, STAT_LOCK_QUEUE);
+        if (proc == NULL) {
+            return woken;
+        }
+        add_proc(proc);
+        woken++;
+    }
+}
+
+int waiting_procs(void) {
+    stats_lock(&queue_lock, STAT_LOCK_QUEUE);
+    int ret = wait_size;
+    stats_unlock(&queue_lock, STAT_LOCK_QUEUE);
+    return ret;
+}
+
+void for_each_proc(void (*fn)(struct pcb_t *proc, void *arg), void *arg) {
+    stats_lock(&queue_lock, STAT_LOCK_QUEUE);
+    for (int i = 0; i < ready_queue.size; i++) {
+        fn(ready_queue.proc[i], arg);
+    }
+    for (int i = 0; i < run_queue.size; i++) {
+        fn(run_queue.proc[i], arg);
+    }
+    for (int i = 0; i < wait_size; i++) {
+        fn(wait_heap[i].proc, arg);
+    }
+    stats_unlock(&queue_lock, STAT_LOCK_QUEUE);
+}
+
+static void save_queue(FILE *file, struct queue_t *q) {
+    ckpt_write_u32(file, q->size);
+    for (int i = 0; i < q->size; i++) {
+        save_proc(file, q->proc[i]);
+    }
+}
+
+static void restore_queue(FILE *file, struct queue_t *q) {
+    q->size = 0;
+    uint32_t size = ckpt_read_u32(file);
+    for (uint32_t i = 0; i < size; i++) {
+        enqueue(q, restore_proc(file));
+    }
+}
+
+void save_scheduler(FILE *file) {
+    save_queue(file, &ready_queue);
+    save_queue(file, &run_queue);
+    ckpt_write_u64(file, rt_util);
+    ckpt_write_u32(file, rt_admitted);
+    ckpt_write_u32(file, rt_rejected);
+    ckpt_write_u32(file, rt_missed);
+    /* The heap is saved as is, its order stays valid */
+    ckpt_write_u64(file, wait_seq);
+    ckpt_write_u32(file, wait_size);
+    for (int i = 0; i < wait_size; i++) {
+        ckpt_write_u64(file, wait_heap[i].wake);
+        ckpt_write_u64(file, wait_heap[i].seq);
+        save_proc(file, wait_heap[i].proc);
+    }
+}
+
+void restore_scheduler(FILE *file) {
+    restore_queue(file, &ready_queue);
+    restore_queue(file, &run_queue);
+    rt_util = ckpt_read_u64(file);
+    rt_admitted = ckpt_read_u32(file);
+    rt_rejected = ckpt_read_u32(file);
+    rt_missed = ckpt_read_u32(file);
+    wait_seq = ckpt_read_u64(file);
+    uint32_t size = ckpt_read_u32(file);
+    for (uint32_t i = 0; i < size; i++) {
+        struct wait_entry_t entry;
+        entry.wake = ckpt_read_u64(file);
+        entry.seq = ckpt_read_u64(file);
+        entry.proc = restore_proc(file);
+        wait_push(entry);
+    }
 }
@@ -0,0 +1,271 @@
+
+#include "stats.h"
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STAT_BUCKETS 32 // bucket i counts samples in [2^i, 2^(i+1)) ns
+#define CACHE_LINE 64
+
+struct stat_hist_t {
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint64_t buckets[STAT_BUCKETS];
+};
+
+/* Counters owned by a single thread, padded so that two threads never
+ * write to the same cache line */
+struct stat_thread_t {
+    struct stat_hist_t lock_wait[STAT_LOCK_COUNT];
+    struct stat_hist_t lock_hold[STAT_LOCK_COUNT];
+    struct stat_hist_t func[STAT_FN_COUNT];
+    uint64_t acquired[STAT_LOCK_COUNT]; // start of the current hold, 0 if none
+    struct stat_thread_t *next;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct stat_cpu_t {
+    uint64_t busy;
+    uint64_t idle;
+} __attribute__((aligned(CACHE_LINE)));
+
+static const char *lock_names[STAT_LOCK_COUNT] = {"mem_lock", "queue_lock", "event_lock", "timer_lock"};
+static const char *func_names[STAT_FN_COUNT] = {"translate", "alloc_mem", "free_mem"};
+
+volatile int stats_on = 0;
+static int stats_used = 0; // collection has been enabled at least once
+static enum stat_format_t stats_format = STAT_FORMAT_TABLE;
+static volatile sig_atomic_t dump_requested = 0;
+
+static __thread struct stat_thread_t *self = NULL;
+static struct stat_thread_t *thread_list = NULL;
+static pthread_mutex_t thread_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct stat_cpu_t *cpu_stat = NULL;
+static int cpu_count = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Counters of the calling thread, registered on first use */
+static struct stat_thread_t *get_self(void) {
+    if (self == NULL) {
+        self = aligned_alloc(CACHE_LINE, sizeof(struct stat_thread_t));
+        memset(self, 0, sizeof(struct stat_thread_t));
+        pthread_mutex_lock(&thread_list_lock);
+        self->next = thread_list;
+        thread_list = self;
+        pthread_mutex_unlock(&thread_list_lock);
+    }
+    return self;
+}
+
+static void hist_add(struct stat_hist_t *hist, uint64_t ns) {
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= STAT_BUCKETS) {
+        bucket = STAT_BUCKETS - 1;
+    }
+    hist->count++;
+    hist->total += ns;
+    if (ns > hist->max) {
+        hist->max = ns;
+    }
+    hist->buckets[bucket]++;
+}
+
+static void hist_merge(struct stat_hist_t *dst, const struct stat_hist_t *src) {
+    dst->count += src->count;
+    dst->total += src->total;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+    for (int i = 0; i < STAT_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+/* Upper bound of the bucket holding the [pct] percentile */
+static uint64_t hist_percentile(const struct stat_hist_t *hist, int pct) {
+    uint64_t target = (hist->count * pct + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < STAT_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target && seen > 0) {
+            uint64_t bound = (2ULL << i) - 1;
+            return bound < hist->max ? bound : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+static void on_sigusr1(int sig) {
+    (void)sig;
+    dump_requested = 1;
+}
+
+static void on_sigusr2(int sig) {
+    (void)sig;
+    stats_on = !stats_on;
+    stats_used = 1;
+}
+
+void init_stats(int num_cpus) {
+    cpu_count = num_cpus;
+    cpu_stat = aligned_alloc(CACHE_LINE, sizeof(struct stat_cpu_t) * num_cpus);
+    memset(cpu_stat, 0, sizeof(struct stat_cpu_t) * num_cpus);
+
+    const char *mode = getenv("OS_STATS");
+    if (mode != NULL && mode[0] != '\0') {
+        stats_format = strcmp(mode, "json") ? STAT_FORMAT_TABLE : STAT_FORMAT_JSON;
+        stats_on = 1;
+        stats_used = 1;
+    }
+    signal(SIGUSR1, on_sigusr1);
+    signal(SIGUSR2, on_sigusr2);
+}
+
+uint64_t stats_begin(void) {
+    return stats_on ? now_ns() : 0;
+}
+
+void stats_end(enum stat_func_t fn, uint64_t start) {
+    if (start == 0) {
+        return;
+    }
+    hist_add(&get_self()->func[fn], now_ns() - start);
+}
+
+void stats_lock(pthread_mutex_t *lock, enum stat_lock_t id) {
+    if (!stats_on) {
+        pthread_mutex_lock(lock);
+        return;
+    }
+    struct stat_thread_t *me = get_self();
+    uint64_t start = now_ns();
+    pthread_mutex_lock(lock);
+    me->acquired[id] = now_ns();
+    hist_add(&me->lock_wait[id], me->acquired[id] - start);
+}
+
+void stats_unlock(pthread_mutex_t *lock, enum stat_lock_t id) {
+    if (self != NULL && self->acquired[id] != 0) {
+        hist_add(&self->lock_hold[id], now_ns() - self->acquired[id]);
+        self->acquired[id] = 0;
+    }
+    pthread_mutex_unlock(lock);
+}
+
+void stats_cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock, enum stat_lock_t id) {
+    /* The lock is released while waiting, so close the current hold and
+     * open a new one once it is reacquired */
+    if (self != NULL && self->acquired[id] != 0) {
+        hist_add(&self->lock_hold[id], now_ns() - self->acquired[id]);
+        self->acquired[id] = 0;
+    }
+    pthread_cond_wait(cond, lock);
+    if (stats_on) {
+        get_self()->acquired[id] = now_ns();
+    }
+}
+
+void stats_cpu_slots(int cpu, int busy, uint64_t slots) {
+    if (!stats_on || cpu < 0 || cpu >= cpu_count) {
+        return;
+    }
+    if (busy) {
+        cpu_stat[cpu].busy += slots;
+    } else {
+        cpu_stat[cpu].idle += slots;
+    }
+}
+
+void stats_poll(void) {
+    if (dump_requested) {
+        dump_requested = 0;
+        stats_dump();
+    }
+}
+
+static void print_hist_table(const char *name, const char *kind, const struct stat_hist_t *hist) {
+    fprintf(stderr, "%-12s %-5s %10" PRIu64 " %14" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %12" PRIu64 "\n",
+            name, kind,
+            hist->count,
+            hist->total,
+            hist->count ? hist->total / hist->count : 0,
+            hist_percentile(hist, 50),
+            hist_percentile(hist, 99),
+            hist->max);
+}
+
+static void print_hist_json(const char *name, const struct stat_hist_t *hist) {
+    fprintf(stderr, "\"%s\":{\"count\":%" PRIu64 ",\"total_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 ",\"buckets\":[",
+            name, hist->count, hist->total, hist->max);
+    for (int i = 0; i < STAT_BUCKETS; i++) {
+        fprintf(stderr, "%s%" PRIu64, i ? "," : "", hist->buckets[i]);
+    }
+    fprintf(stderr, "]}");
+}
+
+void stats_dump(void) {
+    if (!stats_used) {
+        return;
+    }
+    struct stat_thread_t sum;
+    memset(&sum, 0, sizeof(sum));
+    pthread_mutex_lock(&thread_list_lock);
+    for (struct stat_thread_t *t = thread_list; t != NULL; t = t->next) {
+        for (int i = 0; i < STAT_LOCK_COUNT; i++) {
+            hist_merge(&sum.lock_wait[i], &t->lock_wait[i]);
+            hist_merge(&sum.lock_hold[i], &t->lock_hold[i]);
+        }
+        for (int i = 0; i < STAT_FN_COUNT; i++) {
+            hist_merge(&sum.func[i], &t->func[i]);
+        }
+    }
+    pthread_mutex_unlock(&thread_list_lock);
+
+    if (stats_format == STAT_FORMAT_JSON) {
+        fprintf(stderr, "{\"locks\":{");
+        for (int i = 0; i < STAT_LOCK_COUNT; i++) {
+            fprintf(stderr, "%s\"%s\":{", i ? "," : "", lock_names[i]);
+            print_hist_json("wait", &sum.lock_wait[i]);
+            fprintf(stderr, ",");
+            print_hist_json("hold", &sum.lock_hold[i]);
+            fprintf(stderr, "}");
+        }
+        fprintf(stderr, "},\"functions\":{");
+        for (int i = 0; i < STAT_FN_COUNT; i++) {
+            if (i) {
+                fprintf(stderr, ",");
+            }
+            print_hist_json(func_names[i], &sum.func[i]);
+        }
+        fprintf(stderr, "},\"cpus\":[");
+        for (int i = 0; i < cpu_count; i++) {
+            fprintf(stderr, "%s{\"cpu\":%d,\"busy\":%" PRIu64 ",\"idle\":%" PRIu64 "}",
+                    i ? "," : "", i, cpu_stat[i].busy, cpu_stat[i].idle);
+        }
+        fprintf(stderr, "]}\n");
+        return;
+    }
+
+    fprintf(stderr, "%-12s %-5s %10s %14s %10s %10s %10s %12s\n",
+            "NAME", "KIND", "COUNT", "TOTAL(ns)", "AVG(ns)", "P50(ns)", "P99(ns)", "MAX(ns)");
+    for (int i = 0; i < STAT_LOCK_COUNT; i++) {
+        print_hist_table(lock_names[i], "wait", &sum.lock_wait[i]);
+        print_hist_table(lock_names[i], "hold", &sum.lock_hold[i]);
+    }
+    for (int i = 0; i < STAT_FN_COUNT; i++) {
+        print_hist_table(func_names[i], "time", &sum.func[i]);
+    }
+    fprintf(stderr, "%-12s %10s %10s\n", "CPU", "BUSY", "IDLE");
+    for (int i = 0; i < cpu_count; i++) {
+        fprintf(stderr, "%-12d %10" PRIu64 " %10" PRIu64 "\n", i, cpu_stat[i].busy, cpu_stat[i].idle);
+    }
+}
@@ -1,5 +1,6 @@
 
 #include "timer.h"
+#include "stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -14,40 +15,64 @@ static struct timer_id_container_t *dev_list = NULL;
 
 static uint64_t _time;
 
+static void (*tick_hook)(uint64_t time) = NULL;
+
 static int timer_started = 0;
 static int timer_stop = 0;
 
+void advance_time(void) {
+    /* Every device is waiting for the next slot */
+    stats_poll();
+    _time++;
+    void (*hook)(uint64_t time) = __atomic_load_n(&tick_hook, __ATOMIC_ACQUIRE);
+    if (hook != NULL) {
+        hook(_time);
+    }
+}
+
 static void *timer_routine(void *args) {
     while (!timer_stop) {
-        printf("Time slot %3llu\n", current_time());
+        printf("Time slot %3lu\n", (unsigned long)current_time());
         int fsh = 0;
         int event = 0;
         /* Wait for all devices have done the job in current
          * time slot */
         struct timer_id_container_t *temp;
         for (temp = dev_list; temp != NULL; temp = temp->next) {
-            pthread_mutex_lock(&temp->id.event_lock);
+            event++;
+            if (__atomic_load_n(&temp->id.parked, __ATOMIC_ACQUIRE)) {
+                continue; // Parked devices have nothing to do
+            }
+            stats_lock(&temp->id.event_lock, STAT_LOCK_EVENT);
             while (!temp->id.done && !temp->id.fsh) {
-                pthread_cond_wait(
+                stats_cond_wait(
                     &temp->id.event_cond,
-                    &temp->id.event_lock);
+                    &temp->id.event_lock,
+                    STAT_LOCK_EVENT);
             }
             if (temp->id.fsh) {
                 fsh++;
             }
-            event++;
-            pthread_mutex_unlock(&temp->id.event_lock);
+            stats_unlock(&temp->id.event_lock, STAT_LOCK_EVENT);
         }
 
         /* Increase the time slot */
-        _time++;
+        advance_time();
 
         /* Let devices continue their job */
         for (temp = dev_list; temp != NULL; temp = temp->next) {
-            pthread_mutex_lock(&temp->id.timer_lock);
+            if (__atomic_load_n(&temp->id.parked, __ATOMIC_ACQUIRE)) {
+                /* A parked device only resumes at a slot boundary after
+                 * somebody has woken it up */
+                if (!__atomic_exchange_n(&temp->id.wake, 0, __ATOMIC_ACQ_REL)) {
+                    continue;
+                }
+                __atomic_store_n(&temp->id.parked, 0, __ATOMIC_RELEASE);
+            }
+            stats_lock(&temp->id.timer_lock, STAT_LOCK_TIMER);
             temp->id.done = 0;
             pthread_cond_signal(&temp->id.timer_cond);
-            pthread_mutex_unlock(&temp->id.timer_lock);
+            stats_unlock(&temp->id.timer_lock, STAT_LOCK_TIMER);
         }
         if (fsh == event) {
             break;
@@ -58,35 +83,54 @@ static void *timer_routine(void *args) {
 
 void next_slot(struct timer_id_t *timer_id) {
     /* Tell to timer that we have done our job in current slot */
-    pthread_mutex_lock(&timer_id->event_lock);
+    stats_lock(&timer_id->event_lock, STAT_LOCK_EVENT);
     timer_id->done = 1;
     pthread_cond_signal(&timer_id->event_cond);
-    pthread_mutex_unlock(&timer_id->event_lock);
+    stats_unlock(&timer_id->event_lock, STAT_LOCK_EVENT);
 
     /* Wait for going to next slot */
-    pthread_mutex_lock(&timer_id->timer_lock);
+    stats_lock(&timer_id->timer_lock, STAT_LOCK_TIMER);
     while (timer_id->done) {
-        pthread_cond_wait(
+        stats_cond_wait(
             &timer_id->timer_cond,
-            &timer_id->timer_lock);
+            &timer_id->timer_lock,
+            STAT_LOCK_TIMER);
     }
-    pthread_mutex_unlock(&timer_id->timer_lock);
+    stats_unlock(&timer_id->timer_lock, STAT_LOCK_TIMER);
+}
+
+void park_slot(struct timer_id_t *timer_id) {
+    __atomic_store_n(&timer_id->parked, 1, __ATOMIC_RELEASE);
+    next_slot(timer_id);
+}
+
+void unpark_event(struct timer_id_t *timer_id) {
+    __atomic_store_n(&timer_id->wake, 1, __ATOMIC_RELEASE);
 }
 
 uint64_t current_time() {
     return _time;
 }
 
+void set_time(uint64_t time) {
+    _time = time;
+}
+
+void set_tick_hook(void (*hook)(uint64_t time)) {
+    /* May be installed by a device while the clock is running */
+    __atomic_store_n(&tick_hook, hook, __ATOMIC_RELEASE);
+}
+
 void start_timer() {
     timer_started = 1;
     pthread_create(&_timer, NULL, timer_routine, NULL);
 }
 
 void detach_event(struct timer_id_t *event) {
-    pthread_mutex_lock(&event->event_lock);
+    stats_lock(&event->event_lock, STAT_LOCK_EVENT);
     event->fsh = 1;
     pthread_cond_signal(&event->event_cond);
-    pthread_mutex_unlock(&event->event_lock);
+    stats_unlock(&event->event_lock, STAT_LOCK_EVENT);
 }
 
 struct timer_id_t *attach_event() {
@@ -98,6 +142,8 @@ struct timer_id_t *attach_event() {
                 sizeof(struct timer_id_container_t));
         container->id.done = 0;
         container->id.fsh = 0;
+        container->id.parked = 0;
+        container->id.wake = 0;
         pthread_cond_init(&container->id.event_cond, NULL);
         pthread_mutex_init(&container->id.event_lock, NULL);
         pthread_cond_init(&container->id.timer_cond, NULL);
@@ -0,0 +1,206 @@
+
+#include "vspace.h"
+#include "checkpoint.h"
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t bucket_of(uint32_t count) {
+    return 31 - __builtin_clz(count);
+}
+
+static void link_extent(struct vspace_t *vspace, struct vm_extent_t *extent) {
+    uint32_t bucket = bucket_of(extent->count);
+    extent->prev = NULL;
+    extent->next = vspace->buckets[bucket];
+    if (extent->next != NULL) {
+        extent->next->prev = extent;
+    }
+    vspace->buckets[bucket] = extent;
+    vspace->head[extent->start] = extent;
+    vspace->tail[extent->start + extent->count - 1] = extent;
+    vspace->free_pages += extent->count;
+    vspace->extents++;
+}
+
+static void unlink_extent(struct vspace_t *vspace, struct vm_extent_t *extent) {
+    if (extent->prev != NULL) {
+        extent->prev->next = extent->next;
+    } else {
+        vspace->buckets[bucket_of(extent->count)] = extent->next;
+    }
+    if (extent->next != NULL) {
+        extent->next->prev = extent->prev;
+    }
+    vspace->head[extent->start] = NULL;
+    vspace->tail[extent->start + extent->count - 1] = NULL;
+    vspace->free_pages -= extent->count;
+    vspace->extents--;
+}
+
+static struct vm_extent_t *new_extent(uint32_t start, uint32_t count) {
+    struct vm_extent_t *extent = malloc(sizeof(struct vm_extent_t));
+    extent->start = start;
+    extent->count = count;
+    return extent;
+}
+
+struct vspace_t *vspace_create(void) {
+    struct vspace_t *vspace = calloc(1, sizeof(struct vspace_t));
+    /* Page 0 is never handed out, address 0 means failure */
+    link_extent(vspace, new_extent(1, NUM_PAGES - 1));
+    return vspace;
+}
+
+/* Append every extent of [src] to [dst] keeping the order of each bucket,
+ * so that both spaces make the same placement decisions */
+static void copy_buckets(struct vspace_t *dst, const struct vspace_t *src) {
+    for (uint32_t i = 0; i < VSPACE_BUCKETS; i++) {
+        struct vm_extent_t *last = src->buckets[i];
+        while (last != NULL && last->next != NULL) {
+            last = last->next;
+        }
+        for (struct vm_extent_t *e = last; e != NULL; e = e->prev) {
+            link_extent(dst, new_extent(e->start, e->count));
+        }
+    }
+}
+
+struct vspace_t *vspace_clone(const struct vspace_t *vspace) {
+    struct vspace_t *clone = calloc(1, sizeof(struct vspace_t));
+    copy_buckets(clone, vspace);
+    return clone;
+}
+
+void vspace_destroy(struct vspace_t *vspace) {
+    for (uint32_t i = 0; i < VSPACE_BUCKETS; i++) {
+        while (vspace->buckets[i] != NULL) {
+            struct vm_extent_t *extent = vspace->buckets[i];
+            vspace->buckets[i] = extent->next;
+            free(extent);
+        }
+    }
+    free(vspace);
+}
+
+uint32_t vspace_alloc(struct vspace_t *vspace, uint32_t count) {
+    return vspace_alloc_aligned(vspace, count, 1);
+}
+
+/* First page of [extent] aligned to [align] if [count] pages fit there */
+static uint32_t fit(const struct vm_extent_t *extent, uint32_t count, uint32_t align) {
+    uint32_t start = (extent->start + align - 1) / align * align;
+    return start + count <= extent->start + extent->count ? start : 0;
+}
+
+uint32_t vspace_alloc_aligned(struct vspace_t *vspace, uint32_t count, uint32_t align) {
+    if (count == 0 || count >= NUM_PAGES) {
+        return 0;
+    }
+    /* Without alignment only the smallest possible bucket needs to be
+     * searched, any extent of the larger ones is big enough */
+    struct vm_extent_t *found = NULL;
+    uint32_t start = 0;
+    for (uint32_t i = bucket_of(count); i < VSPACE_BUCKETS && found == NULL; i++) {
+        for (struct vm_extent_t *e = vspace->buckets[i]; e != NULL && found == NULL; e = e->next) {
+            if ((start = fit(e, count, align)) != 0) {
+                found = e;
+            }
+        }
+    }
+    if (found == NULL) {
+        return 0;
+    }
+
+    unlink_extent(vspace, found);
+    if (start > found->start) {
+        link_extent(vspace, new_extent(found->start, start - found->start));
+    }
+    uint32_t end = found->start + found->count;
+    if (end > start + count) {
+        found->start = start + count;
+        found->count = end - found->start;
+        link_extent(vspace, found);
+    } else {
+        free(found);
+    }
+    return start;
+}
+
+void vspace_free(struct vspace_t *vspace, uint32_t start, uint32_t count) {
+    if (count == 0) {
+        return;
+    }
+    struct vm_extent_t *extent = new_extent(start, count);
+    struct vm_extent_t *left = start > 0 ? vspace->tail[start - 1] : NULL;
+    if (left != NULL) {
+        unlink_extent(vspace, left);
+        extent->start = left->start;
+        extent->count += left->count;
+        free(left);
+    }
+    struct vm_extent_t *right = start + count < NUM_PAGES ? vspace->head[start + count] : NULL;
+    if (right != NULL) {
+        unlink_extent(vspace, right);
+        extent->count += right->count;
+        free(right);
+    }
+    link_extent(vspace, extent);
+}
+
+uint32_t vspace_largest(const struct vspace_t *vspace) {
+    for (int i = VSPACE_BUCKETS - 1; i >= 0; i--) {
+        uint32_t largest = 0;
+        for (struct vm_extent_t *e = vspace->buckets[i]; e != NULL; e = e->next) {
+            if (e->count > largest) {
+                largest = e->count;
+            }
+        }
+        if (largest != 0) {
+            return largest;
+        }
+    }
+    return 0;
+}
+
+uint32_t vspace_fragmentation(const struct vspace_t *vspace) {
+    if (vspace->free_pages == 0) {
+        return 0;
+    }
+    return 100 - vspace_largest(vspace) * 100 / vspace->free_pages;
+}
+
+void save_vspace(FILE *file, const struct vspace_t *vspace) {
+    for (uint32_t i = 0; i < VSPACE_BUCKETS; i++) {
+        uint32_t count = 0;
+        for (struct vm_extent_t *e = vspace->buckets[i]; e != NULL; e = e->next) {
+            count++;
+        }
+        ckpt_write_u32(file, count);
+        /* Oldest first, restore_vspace pushes them back in this order */
+        struct vm_extent_t *last = vspace->buckets[i];
+        while (last != NULL && last->next != NULL) {
+            last = last->next;
+        }
+        for (struct vm_extent_t *e = last; e != NULL; e = e->prev) {
+            ckpt_write_u32(file, e->start);
+            ckpt_write_u32(file, e->count);
+        }
+    }
+}
+
+struct vspace_t *restore_vspace(FILE *file) {
+    struct vspace_t *vspace = calloc(1, sizeof(struct vspace_t));
+    for (uint32_t i = 0; i < VSPACE_BUCKETS; i++) {
+        uint32_t count = ckpt_read_u32(file);
+        for (uint32_t j = 0; j < count; j++) {
+            uint32_t start = ckpt_read_u32(file);
+            uint32_t pages = ckpt_read_u32(file);
+            if (pages == 0 || start + pages > NUM_PAGES) {
+                printf("Checkpoint is corrupted\n");
+                exit(1);
+            }
+            link_extent(vspace, new_extent(start, pages));
+        }
+    }
+    return vspace;
+}